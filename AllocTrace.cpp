@@ -0,0 +1,274 @@
+﻿#include "AllocTrace.h"
+
+#ifdef ALLOC_TRACE_ENABLED
+#include <chrono>
+#include <cstring>
+#include <new>
+
+std::atomic<bool> AllocTrace::_active{ false };
+
+// 本线程正在记录器里：写文件、登记线程退出钩子时可能再申请释放内存，这些不记录，也避免重入死锁
+static thread_local bool tlsInTrace = false;
+// 本线程的编号（0 表示还没记录过）和缓冲；线程退出后不再申请缓冲，改用共用缓冲
+static thread_local uint32_t tlsTraceThread = 0;
+static thread_local TraceBuffer* tlsTraceBuffer = nullptr;
+static thread_local bool tlsTraceExited = false;
+
+// 线程退出钩子：thread_local 对象的析构
+struct TraceThreadExit
+{
+	~TraceThreadExit()
+	{
+		AllocTrace::GetInstance()->ReleaseBuffer();
+	}
+};
+
+static uint64_t TraceNow()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool AllocTrace::Start(const char* path)
+{
+	Stop();
+
+	std::lock_guard<std::mutex> control(_controlMtx);
+	bool outer = tlsInTrace;
+	tlsInTrace = true;
+
+	FILE* file = fopen(path, "wb");
+	if (file == nullptr)
+	{
+		tlsInTrace = outer;
+		return false;
+	}
+	// 记录整块写入，不需要 stdio 的缓冲；无缓冲时 fork 出的子进程退出也不会把父进程没写完的数据再写一遍
+	setvbuf(file, nullptr, _IONBF, 0);
+
+	TraceHeader header;
+	memcpy(header._magic, TRACE_MAGIC, sizeof(header._magic));
+	header._version = TRACE_VERSION;
+	header._recordSize = sizeof(TraceRecord);
+	fwrite(&header, sizeof(header), 1, file);
+
+	// 丢掉上一段结束时还没写进缓冲的记录
+	{
+		std::lock_guard<std::mutex> list(_listMtx);
+		for (TraceBuffer* buf = _buffers; buf != nullptr; buf = buf->_next)
+		{
+			std::lock_guard<std::mutex> lock(buf->_mtx);
+			buf->_used = 0;
+		}
+		std::lock_guard<std::mutex> lock(_shared._mtx);
+		_shared._used = 0;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_fileMtx);
+		_file = file;
+		_written = 0;
+	}
+	_startTime.store(TraceNow(), std::memory_order_relaxed);
+	_active.store(true, std::memory_order_release);
+
+	tlsInTrace = outer;
+	return true;
+}
+
+size_t AllocTrace::Stop()
+{
+	std::lock_guard<std::mutex> control(_controlMtx);
+	if (!_active.exchange(false))
+	{
+		return 0;
+	}
+
+	bool outer = tlsInTrace;
+	tlsInTrace = true;
+
+	{
+		std::lock_guard<std::mutex> list(_listMtx);
+		for (TraceBuffer* buf = _buffers; buf != nullptr; buf = buf->_next)
+		{
+			std::lock_guard<std::mutex> lock(buf->_mtx);
+			FlushLocked(buf);
+		}
+		std::lock_guard<std::mutex> lock(_shared._mtx);
+		FlushLocked(&_shared);
+	}
+
+	size_t written = 0;
+	{
+		std::lock_guard<std::mutex> lock(_fileMtx);
+		fclose(_file);
+		_file = nullptr;
+		written = _written;
+	}
+
+	tlsInTrace = outer;
+	return written;
+}
+
+void AllocTrace::Record(TraceOp op, void* ptr, size_t size)
+{
+	if (tlsInTrace)
+	{
+		return;
+	}
+	tlsInTrace = true;
+
+	if (tlsTraceThread == 0)
+	{
+		tlsTraceThread = _nextThread.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	TraceBuffer* buf = tlsTraceBuffer;
+	if (buf == nullptr)
+	{
+		buf = AcquireBuffer();
+	}
+
+	TraceRecord r;
+	r._time = TraceNow() - _startTime.load(std::memory_order_relaxed);
+	r._object = (uint64_t)(uintptr_t)ptr;
+	r._info = TraceRecord::MakeInfo(op, tlsTraceThread, size);
+
+	{
+		std::lock_guard<std::mutex> lock(buf->_mtx);
+		buf->_records[buf->_used++] = r;
+		if (buf->_used == TRACE_BUFFER_RECORDS)
+		{
+			FlushLocked(buf);
+		}
+	}
+
+	tlsInTrace = false;
+}
+
+TraceBuffer* AllocTrace::AcquireBuffer()
+{
+	if (tlsTraceExited)
+	{
+		return &_shared;
+	}
+
+	// 第一次用到时构造，登记析构（可能调 calloc，在 tlsInTrace 保护下不记录）
+	thread_local TraceThreadExit exitHook;
+	(void)exitHook;
+
+	TraceBuffer* buf = nullptr;
+	{
+		std::lock_guard<std::mutex> list(_listMtx);
+		buf = _freeBuffers;
+		if (buf != nullptr)
+		{
+			_freeBuffers = buf->_nextFree;
+		}
+	}
+
+	if (buf == nullptr)
+	{
+		// 缓冲直接向系统要页，不经过内存池，也就不会再进到记录器
+		size_t kpage = SizeClass::_RoundUp(sizeof(TraceBuffer), (size_t)1 << PAGE_SHIFT) >> PAGE_SHIFT;
+		try
+		{
+			buf = new (SystemAlloc(kpage)) TraceBuffer;
+		}
+		catch (const std::bad_alloc&)
+		{
+			return &_shared;
+		}
+
+		std::lock_guard<std::mutex> list(_listMtx);
+		buf->_next = _buffers;
+		_buffers = buf;
+	}
+
+	tlsTraceBuffer = buf;
+	return buf;
+}
+
+void AllocTrace::ReleaseBuffer()
+{
+	TraceBuffer* buf = tlsTraceBuffer;
+	tlsTraceBuffer = nullptr;
+	tlsTraceExited = true;
+	if (buf == nullptr)
+	{
+		return;
+	}
+
+	bool outer = tlsInTrace;
+	tlsInTrace = true;
+	{
+		std::lock_guard<std::mutex> lock(buf->_mtx);
+		FlushLocked(buf);
+	}
+	{
+		std::lock_guard<std::mutex> list(_listMtx);
+		buf->_nextFree = _freeBuffers;
+		_freeBuffers = buf;
+	}
+	tlsInTrace = outer;
+}
+
+void AllocTrace::FlushLocked(TraceBuffer* buf)
+{
+	if (buf->_used == 0)
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(_fileMtx);
+	if (_file != nullptr)
+	{
+		_written += fwrite(buf->_records, sizeof(TraceRecord), buf->_used, _file);
+	}
+	buf->_used = 0;
+}
+
+// 加锁顺序和 Stop 一致：控制 -> 缓冲链表 -> 各缓冲 -> 文件
+void AllocTrace::LockAll()
+{
+	_controlMtx.lock();
+	_listMtx.lock();
+	for (TraceBuffer* buf = _buffers; buf != nullptr; buf = buf->_next)
+	{
+		buf->_mtx.lock();
+	}
+	_shared._mtx.lock();
+	_fileMtx.lock();
+}
+
+void AllocTrace::UnlockAll()
+{
+	_fileMtx.unlock();
+	_shared._mtx.unlock();
+	for (TraceBuffer* buf = _buffers; buf != nullptr; buf = buf->_next)
+	{
+		buf->_mtx.unlock();
+	}
+	_listMtx.unlock();
+	_controlMtx.unlock();
+}
+
+void AllocTrace::StopInChild()
+{
+	std::lock_guard<std::mutex> control(_controlMtx);
+	if (!_active.exchange(false))
+	{
+		return;
+	}
+
+	// 缓冲里是 fork 前父进程的记录，由父进程写出；子进程只关掉自己这份文件描述符
+	bool outer = tlsInTrace;
+	tlsInTrace = true;
+	{
+		std::lock_guard<std::mutex> lock(_fileMtx);
+		fclose(_file);
+		_file = nullptr;
+	}
+	tlsInTrace = outer;
+}
+#endif
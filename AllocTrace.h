@@ -0,0 +1,144 @@
+﻿#pragma once
+#include "Common.h"
+#include <cstdio>
+
+// 申请/释放轨迹记录（可选，编译期开启）：编译时定义 USE_ALLOC_TRACE
+// 开启后每次 ConcurrentAlloc / ConcurrentFree（以及批量、对齐、realloc 等入口）都记一条，用 TraceReplay 按原来的线程数重放
+// 未开启时记录点是空的内联函数，快路径没有任何额外开销
+#ifdef USE_ALLOC_TRACE
+#define ALLOC_TRACE_ENABLED 1
+#endif
+
+// 轨迹文件格式：文件头之后是一条条定长记录，各线程的缓冲整块写入，文件里不按时间排序，重放前按 _time 排
+static const char TRACE_MAGIC[8] = { 'C', 'M', 'T', 'R', 'A', 'C', 'E', '\0' };
+static const uint32_t TRACE_VERSION = 1;
+
+struct TraceHeader
+{
+	char _magic[8];
+	uint32_t _version;
+	uint32_t _recordSize;				// sizeof(TraceRecord)，读的一方据此校验
+};
+
+enum TraceOp : uint32_t
+{
+	TRACE_ALLOC = 0,
+	TRACE_FREE = 1,
+};
+
+// 线程号和大小的位数：线程号从 1 开始按线程第一次记录的顺序编号，大小最多 1TB
+static const int TRACE_THREAD_BITS = 23;
+static const int TRACE_SIZE_BITS = 40;
+
+// 一条记录 24 字节：操作、线程号、大小拼在一个 uint64 里
+// 对象用地址标识，同一地址释放后再申请就是新对象，TraceReplay 读入时按时间顺序换成对象编号
+// 申请在拿到地址之后、释放在归还之前取时间，同一地址的前后两次使用在时间上不会交错
+struct TraceRecord
+{
+	uint64_t _time;						// 距离开始记录的纳秒数
+	uint64_t _object;					// 对象地址
+	uint64_t _info;						// 低 1 位操作，接着 23 位线程号，高 40 位大小
+
+	TraceOp Op() const { return (TraceOp)(_info & 1); }
+	uint32_t Thread() const { return (uint32_t)((_info >> 1) & (((uint64_t)1 << TRACE_THREAD_BITS) - 1)); }
+	size_t Size() const { return (size_t)(_info >> (1 + TRACE_THREAD_BITS)); }
+
+	static uint64_t MakeInfo(TraceOp op, uint32_t thread, size_t size)
+	{
+		uint64_t threadMask = ((uint64_t)1 << TRACE_THREAD_BITS) - 1;
+		uint64_t sizeMask = ((uint64_t)1 << TRACE_SIZE_BITS) - 1;
+		return (uint64_t)op | (((uint64_t)thread & threadMask) << 1) | (((uint64_t)size & sizeMask) << (1 + TRACE_THREAD_BITS));
+	}
+};
+static_assert(sizeof(TraceRecord) == 24, "trace records are written as raw bytes");
+
+#ifdef ALLOC_TRACE_ENABLED
+// 每块线程缓冲的记录条数，写满了整块追加到文件
+static const size_t TRACE_BUFFER_RECORDS = 4096;
+
+// 一个线程的记录缓冲：只有自己的线程往里写，加锁是为了结束记录时别的线程能把它写出去
+struct TraceBuffer
+{
+	std::mutex _mtx;
+	size_t _used = 0;
+	TraceBuffer* _next = nullptr;		// 所有缓冲的链表，结束记录时逐个写出
+	TraceBuffer* _nextFree = nullptr;	// 线程退出后缓冲挂到空闲链表，给新线程复用
+	TraceRecord _records[TRACE_BUFFER_RECORDS];
+};
+
+// 单例模式
+class AllocTrace
+{
+public:
+	static AllocTrace* GetInstance()
+	{
+		return LeakySingleton<AllocTrace>();
+	}
+
+	static bool Active()
+	{
+		return _active.load(std::memory_order_relaxed);
+	}
+
+	// 开始记录到 path（覆盖），打不开返回 false；已经在记录时先结束上一段
+	bool Start(const char* path);
+	// 结束记录：把所有线程缓冲里的记录写出去并关闭文件，返回这一段写出的记录条数
+	// 和结束同时进行的申请释放可能记不上
+	size_t Stop();
+
+	void Record(TraceOp op, void* ptr, size_t size);
+
+	// 线程退出时调用：写出本线程的缓冲，缓冲留给新线程复用
+	void ReleaseBuffer();
+
+	// fork 前后调用；子进程里的记录不属于父进程的轨迹，解锁后在子进程里关掉
+	void LockAll();
+	void UnlockAll();
+	void StopInChild();
+
+private:
+	static std::atomic<bool> _active;
+	std::atomic<uint32_t> _nextThread{ 1 };
+	std::atomic<uint64_t> _startTime{ 0 };
+
+	std::mutex _controlMtx;				// 串行化 Start / Stop
+	std::mutex _listMtx;				// 保护缓冲链表
+	TraceBuffer* _buffers = nullptr;
+	TraceBuffer* _freeBuffers = nullptr;
+	// 线程退出后、或者申请不到缓冲时的记录，各线程共用，记录里带着线程号
+	TraceBuffer _shared;
+
+	std::mutex _fileMtx;				// 保护文件和计数
+	FILE* _file = nullptr;
+	size_t _written = 0;
+
+	TraceBuffer* AcquireBuffer();
+	// 调用方持有 buf->_mtx
+	void FlushLocked(TraceBuffer* buf);
+
+	AllocTrace() {}
+
+	AllocTrace(const AllocTrace&) = delete;
+	friend AllocTrace* LeakySingleton<AllocTrace>();
+};
+
+static inline void* TraceAlloc(void* ptr, size_t size)
+{
+	if (AllocTrace::Active())
+	{
+		AllocTrace::GetInstance()->Record(TRACE_ALLOC, ptr, size);
+	}
+	return ptr;
+}
+
+static inline void TraceFree(void* ptr, size_t size)
+{
+	if (AllocTrace::Active())
+	{
+		AllocTrace::GetInstance()->Record(TRACE_FREE, ptr, size);
+	}
+}
+#else
+static inline void* TraceAlloc(void* ptr, size_t) { return ptr; }
+static inline void TraceFree(void*, size_t) {}
+#endif
@@ -0,0 +1,114 @@
+﻿#include "AllocatorStats.h"
+#include "ThreadCache.h"
+#include "CpuCache.h"
+#include "TransferCache.h"
+#include "CentralCache.h"
+#include "PageCache.h"
+#include <cstdio>
+
+void SizeClassStats::Add(const SizeClassStats& other)
+{
+	_inUseBytes += other._inUseBytes;
+	_threadCacheBytes += other._threadCacheBytes;
+	_transferCacheBytes += other._transferCacheBytes;
+	_centralCacheBytes += other._centralCacheBytes;
+	_spans += other._spans;
+	_spanTailBytes += other._spanTailBytes;
+	_threadCacheMisses += other._threadCacheMisses;
+	_transferCacheMisses += other._transferCacheMisses;
+	_centralCacheMisses += other._centralCacheMisses;
+}
+
+AllocatorStats GetAllocatorStats()
+{
+	AllocatorStats stats;
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		stats._classes[i]._objSize = SizeClass::ClassSize(i);
+	}
+
+	// 从前往后逐层读，每层只拿自己的锁
+	ThreadCache::CollectStats(stats);
+#ifdef PERCPU_CACHE_ENABLED
+	CpuCache::GetInstance()->CollectStats(stats);
+#endif
+	TransferCache::GetInstance()->CollectStats(stats);
+	CentralCache::GetInstance()->CollectStats(stats);
+	{
+		std::lock_guard<std::mutex> lock(PageCache::GetInstance()->_pageMtx);
+		PageCache::GetInstance()->CollectStats(stats);
+	}
+
+	// CentralCache 只知道分出去了多少，减去还缓存在上层的才是应用在用的
+	// 各层不是同一时刻读的，结果可能略有出入，减成负数时记 0
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		SizeClassStats& cls = stats._classes[i];
+		size_t cached = cls._threadCacheBytes + cls._transferCacheBytes;
+		cls._inUseBytes = cls._inUseBytes > cached ? cls._inUseBytes - cached : 0;
+
+		stats._smallTotal.Add(cls);
+	}
+
+	// 向系统要的页要么空闲、要么已归还、要么切给了 CentralCache，剩下的就是大对象
+	size_t accounted = stats._pageHeapFreeBytes + stats._pageHeapReleasedBytes + stats._pageHeapSpanBytes;
+	stats._largeInUseBytes = stats._systemBytes > accounted ? stats._systemBytes - accounted : 0;
+
+	return stats;
+}
+
+static double ToMB(size_t bytes)
+{
+	return (double)bytes / (1024 * 1024);
+}
+
+void AllocatorStats::Print(std::ostream& os) const
+{
+	char line[256];
+
+	os << "------------------------------------------------\n";
+	snprintf(line, sizeof(line), "应用使用中：   %10.2f MB（小对象 %.2f MB，大对象 %.2f MB）\n",
+		ToMB(_smallTotal._inUseBytes + _largeInUseBytes), ToMB(_smallTotal._inUseBytes), ToMB(_largeInUseBytes));
+	os << line;
+	snprintf(line, sizeof(line), "ThreadCache：  %10.2f MB 缓存，%zu 个线程，慢路径 %zu 次\n",
+		ToMB(_smallTotal._threadCacheBytes), _threadCaches, _smallTotal._threadCacheMisses);
+	os << line;
+	snprintf(line, sizeof(line), "               总上限 %.2f MB，已分给各线程 %.2f MB\n",
+		ToMB(_threadCacheBudget), ToMB(_threadCacheLimitBytes));
+	os << line;
+	snprintf(line, sizeof(line), "TransferCache：%10.2f MB 缓存，未命中 %zu 次\n",
+		ToMB(_smallTotal._transferCacheBytes), _smallTotal._transferCacheMisses);
+	os << line;
+	snprintf(line, sizeof(line), "CentralCache： %10.2f MB 空闲，%zu 个 span（%.2f MB），向 PageCache 要 span %zu 次\n",
+		ToMB(_smallTotal._centralCacheBytes), _smallTotal._spans, ToMB(_pageHeapSpanBytes), _smallTotal._centralCacheMisses);
+	os << line;
+	snprintf(line, sizeof(line), "               span 末尾浪费 %.2f MB\n", ToMB(_smallTotal._spanTailBytes));
+	os << line;
+	snprintf(line, sizeof(line), "PageCache：    %10.2f MB 空闲，%.2f MB 已还给系统，%zu 个空闲 span\n",
+		ToMB(_pageHeapFreeBytes), ToMB(_pageHeapReleasedBytes), _pageHeapFreeSpans);
+	os << line;
+	snprintf(line, sizeof(line), "系统：         %10.2f MB，申请 %zu 次\n",
+		ToMB(_systemBytes), _systemAllocs);
+	os << line;
+	os << "------------------------------------------------\n";
+
+	// 逐个尺寸类：单位 KB，只列出用过的
+	snprintf(line, sizeof(line), "%6s %8s %10s %10s %10s %10s %7s %8s %10s %10s %10s\n",
+		"class", "size", "inuse(KB)", "tc(KB)", "xfer(KB)", "cc(KB)", "spans", "tail(KB)", "tcMiss", "xferMiss", "ccMiss");
+	os << line;
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		const SizeClassStats& cls = _classes[i];
+		if (cls._spans == 0 && cls._threadCacheMisses == 0 && cls._centralCacheMisses == 0)
+		{
+			continue;
+		}
+
+		snprintf(line, sizeof(line), "%6zu %8zu %10zu %10zu %10zu %10zu %7zu %8zu %10zu %10zu %10zu\n",
+			i, cls._objSize, cls._inUseBytes >> 10, cls._threadCacheBytes >> 10, cls._transferCacheBytes >> 10,
+			cls._centralCacheBytes >> 10, cls._spans, cls._spanTailBytes >> 10,
+			cls._threadCacheMisses, cls._transferCacheMisses, cls._centralCacheMisses);
+		os << line;
+	}
+	os << "------------------------------------------------" << endl;
+}
@@ -0,0 +1,49 @@
+﻿#pragma once
+#include "Common.h"
+#include <ostream>
+
+// 一个尺寸类在各层的统计
+struct SizeClassStats
+{
+	size_t _objSize = 0;				// 对象大小
+
+	size_t _inUseBytes = 0;				// 应用正在用的
+	size_t _threadCacheBytes = 0;		// 前端缓存（ThreadCache 或 CpuCache）里的
+	size_t _transferCacheBytes = 0;		// TransferCache 暂存的
+	size_t _centralCacheBytes = 0;		// span 里还没分出去的（含未切分区域）
+	size_t _spans = 0;					// CentralCache 持有的 span 个数
+	size_t _spanTailBytes = 0;			// 这些 span 末尾装不下一个对象的字节
+
+	size_t _threadCacheMisses = 0;		// 前端慢路径次数：本地没货去取 + 本地太多去还
+	size_t _transferCacheMisses = 0;	// TransferCache 没有可取的批次 / 满了放不下
+	size_t _centralCacheMisses = 0;		// CentralCache 没有空闲 span，向 PageCache 要新 span
+
+	// 把 other 累加进来（统计各层合计用）
+	void Add(const SizeClassStats& other);
+};
+
+// 整个内存池的统计快照：各层分别加锁读取，不是严格一致的瞬间快照，但每一项本身是准确的
+struct AllocatorStats
+{
+	SizeClassStats _classes[NFREELISTS];
+	SizeClassStats _smallTotal;			// 所有尺寸类合计，即 ThreadCache / TransferCache / CentralCache 各层的总量
+
+	size_t _threadCaches = 0;			// 存活的 ThreadCache 个数
+	size_t _threadCacheBudget = 0;		// 所有 ThreadCache 合计的字节上限
+	size_t _threadCacheLimitBytes = 0;	// 已分给各线程的上限之和
+
+	size_t _largeInUseBytes = 0;		// 大对象（> MAX_BYTES）占用的页
+	size_t _pageHeapFreeBytes = 0;		// PageCache 里已提交的空闲页
+	size_t _pageHeapReleasedBytes = 0;	// PageCache 里已还给系统的空闲页
+	size_t _pageHeapFreeSpans = 0;		// PageCache 里空闲 span 个数
+	size_t _pageHeapSpanBytes = 0;		// 交给 CentralCache 切小对象的 span 总字节
+	size_t _systemBytes = 0;			// PageCache 向系统申请的总字节
+	size_t _systemAllocs = 0;			// PageCache 向系统申请的次数（PageCache 的慢路径）
+
+	// 输出可读的统计报告：先各层汇总，再逐个尺寸类（跳过从没用过的）
+	void Print(std::ostream& os) const;
+};
+
+// 汇总各层计数：线程缓存的计数是各线程自己维护的，这里按需读取累加
+// 会依次加各层的锁，不要在持有内存池内部锁时调用
+AllocatorStats GetAllocatorStats();
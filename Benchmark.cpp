@@ -1,4 +1,34 @@
 ﻿#include "ConcurrentAlloc.h"
+#ifdef _WIN32
+    #include <Psapi.h>
+#endif
+
+// 当前进程常驻内存（RSS），单位 KB
+static size_t CurrentRSSKB()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+    {
+        return pmc.WorkingSetSize / 1024;
+    }
+    return 0;
+#else
+    // /proc/self/statm 第二列是常驻页数
+    size_t pages = 0, resident = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (fp == nullptr)
+    {
+        return 0;
+    }
+    if (fscanf(fp, "%zu %zu", &pages, &resident) != 2)
+    {
+        resident = 0;
+    }
+    fclose(fp);
+    return resident * (size_t)sysconf(_SC_PAGESIZE) / 1024;
+#endif
+}
 
 // ntimes:一轮申请和释放内存的次数
 // rounds:轮次
@@ -117,16 +147,283 @@ void BenchmarkConcurrentMalloc(size_t ntimes, size_t nworks, size_t rounds)
         nworks, nworks * rounds * ntimes, total_costtime);
 }
 
+// 线程反复创建/退出：每个线程退出前把对象都还到自己的 ThreadCache
+// ThreadCache 析构时归还给中心缓存，RSS 应该在第一轮之后保持平稳
+void BenchmarkThreadChurn(size_t ntimes, size_t nworks, size_t cycles)
+{
+    for (size_t c = 0; c < cycles; ++c)
+    {
+        std::vector<std::thread> vthread(nworks);
+        for (size_t k = 0; k < nworks; ++k)
+        {
+            vthread[k] = std::thread([&]() {
+                std::vector<void*> v;
+                v.reserve(ntimes);
+                for (size_t i = 0; i < ntimes; i++)
+                {
+                    v.push_back(ConcurrentAlloc((16 + i) % 8192 + 1));
+                }
+                for (size_t i = 0; i < ntimes; i++)
+                {
+                    ConcurrentFree(v[i]);
+                }
+            });
+        }
+
+        for (auto& t : vthread)
+        {
+            t.join();
+        }
+
+        printf("线程反复创建销毁 第%zu轮（%zu个线程，每线程%zu次）：RSS %zu KB\n",
+            c + 1, nworks, ntimes, CurrentRSSKB());
+    }
+}
+
+// 生产者/消费者：一半线程只申请，另一半线程只释放，对象全部跨线程归还
+// 释放方还回去的整批对象经中转缓存直接交给申请方
+void BenchmarkProducerConsumer(size_t ntimes, size_t npairs, size_t rounds)
+{
+    std::mutex mtx;
+    std::vector<std::vector<void*>> queue;
+    std::atomic<size_t> producersLeft = npairs;
+
+    size_t begin = clock();
+    std::vector<std::thread> vthread;
+    for (size_t k = 0; k < npairs; ++k)
+    {
+        vthread.emplace_back([&]() {
+            for (size_t j = 0; j < rounds; ++j)
+            {
+                std::vector<void*> v;
+                v.reserve(ntimes);
+                for (size_t i = 0; i < ntimes; i++)
+                {
+                    v.push_back(ConcurrentAlloc((16 + i) % 1024 + 1));
+                }
+
+                std::lock_guard<std::mutex> lock(mtx);
+                queue.push_back(std::move(v));
+            }
+            --producersLeft;
+        });
+
+        vthread.emplace_back([&]() {
+            while (true)
+            {
+                std::vector<void*> v;
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    if (!queue.empty())
+                    {
+                        v = std::move(queue.back());
+                        queue.pop_back();
+                    }
+                    else if (producersLeft == 0)
+                    {
+                        break;
+                    }
+                }
+
+                for (void* p : v)
+                {
+                    ConcurrentFree(p);
+                }
+            }
+        });
+    }
+
+    for (auto& t : vthread)
+    {
+        t.join();
+    }
+    size_t end = clock();
+
+    printf("%zu对生产者/消费者线程，跨线程alloc&dealloc %zu次，总计花费：%zu ms\n",
+        npairs, npairs * rounds * ntimes, end - begin);
+}
+
+// 大量常驻对象：先让每个线程持有 nlive 个对象（产生大量对象分完的 span），再反复申请/释放
+// 中心缓存每次取 span 都要越过这些满 span，考察 GetOneSpan 的开销
+void BenchmarkLargeLiveSet(size_t nlive, size_t ntimes, size_t nworks, size_t rounds)
+{
+    std::vector<std::thread> vthread(nworks);
+    std::atomic<size_t> livetime = 0;
+    std::atomic<size_t> costtime = 0;
+
+    for (size_t k = 0; k < nworks; ++k)
+    {
+        vthread[k] = std::thread([&]() {
+            std::vector<void*> live;
+            live.reserve(nlive);
+            size_t begin1 = clock();
+            for (size_t i = 0; i < nlive; i++)
+            {
+                live.push_back(ConcurrentAlloc((16 + i) % 1024 + 1));
+            }
+            livetime += clock() - begin1;
+
+            std::vector<void*> v;
+            v.reserve(ntimes);
+            size_t begin = clock();
+            for (size_t j = 0; j < rounds; ++j)
+            {
+                for (size_t i = 0; i < ntimes; i++)
+                {
+                    v.push_back(ConcurrentAlloc((16 + i) % 1024 + 1));
+                }
+                for (size_t i = 0; i < ntimes; i++)
+                {
+                    ConcurrentFree(v[i]);
+                }
+                v.clear();
+            }
+            costtime += clock() - begin;
+
+            for (void* p : live)
+            {
+                ConcurrentFree(p);
+            }
+        });
+    }
+
+    for (auto& t : vthread)
+    {
+        t.join();
+    }
+
+    printf("%zu个线程各申请%zu个常驻对象：花费：%zu ms\n",
+        nworks, nlive, livetime.load());
+    printf("%zu个线程各常驻%zu个对象，再执行%zu轮次alloc&dealloc %zu次：花费：%zu ms\n",
+        nworks, nlive, rounds, ntimes, costtime.load());
+}
+
+// 突发批量：每次申请一批同尺寸对象，处理完再整批释放（类似收发包的流水线）
+// 对比逐个 ConcurrentAlloc/ConcurrentFree 和 ConcurrentAllocBatch/ConcurrentFreeBatch
+void BenchmarkBurst(size_t size, size_t burst, size_t nbursts, size_t nworks)
+{
+    for (int useBatch = 0; useBatch < 2; ++useBatch)
+    {
+        std::vector<std::thread> vthread(nworks);
+        std::atomic<size_t> costtime = 0;
+
+        for (size_t k = 0; k < nworks; ++k)
+        {
+            vthread[k] = std::thread([&]() {
+                std::vector<void*> v(burst);
+
+                size_t begin = clock();
+                for (size_t j = 0; j < nbursts; ++j)
+                {
+                    if (useBatch)
+                    {
+                        ConcurrentAllocBatch(size, burst, v.data());
+                        ConcurrentFreeBatch(v.data(), burst);
+                    }
+                    else
+                    {
+                        for (size_t i = 0; i < burst; ++i)
+                        {
+                            v[i] = ConcurrentAlloc(size);
+                        }
+                        for (size_t i = 0; i < burst; ++i)
+                        {
+                            ConcurrentFree(v[i]);
+                        }
+                    }
+                }
+                size_t end = clock();
+
+                costtime += (end - begin);
+            });
+        }
+
+        for (auto& t : vthread)
+        {
+            t.join();
+        }
+
+        printf("%zu个线程，每批%zu个%zu字节对象（%s）alloc&dealloc %zu批：花费：%zu ms\n",
+            nworks, burst, size, useBatch ? "批量接口" : "逐个申请释放", nbursts, costtime.load());
+    }
+}
+
+// 乒乓：反复申请一组对象再全部释放，组的大小略超过一批
+// 本地链表装不下这一组时，每轮释放都会溢出、每轮申请都会落空，两头都要进中转/中心缓存加锁
+void BenchmarkPingPong(size_t size, size_t nrounds, size_t nworks)
+{
+    size_t working = SizeClass::NumMoveSize(size) * 3 / 2;
+    size_t missesBefore = GetAllocatorStats()._smallTotal._threadCacheMisses;
+
+    std::vector<std::thread> vthread(nworks);
+    std::atomic<size_t> costtime = 0;
+    for (size_t k = 0; k < nworks; ++k)
+    {
+        vthread[k] = std::thread([&]() {
+            std::vector<void*> v(working);
+
+            size_t begin = clock();
+            for (size_t j = 0; j < nrounds; ++j)
+            {
+                for (size_t i = 0; i < working; ++i)
+                {
+                    v[i] = ConcurrentAlloc(size);
+                }
+                for (size_t i = 0; i < working; ++i)
+                {
+                    ConcurrentFree(v[i]);
+                }
+            }
+            size_t end = clock();
+
+            costtime += (end - begin);
+        });
+    }
+
+    for (auto& t : vthread)
+    {
+        t.join();
+    }
+
+    size_t misses = GetAllocatorStats()._smallTotal._threadCacheMisses - missesBefore;
+    printf("%zu个线程，每轮%zu个%zu字节对象 alloc&dealloc %zu轮：花费：%zu ms，线程缓存慢路径 %zu 次\n",
+        nworks, working, size, nrounds, costtime.load(), misses);
+}
+
 int main()
 {
     size_t n = 50000;   //  每个线程、每一轮要执行的分配/释放次数（次数越大，压力越高）
     cout << "=============================================" << endl;
+#ifdef PERCPU_CACHE_ENABLED
+    // 分别用 -DUSE_PERCPU_CACHE 和不加宏各编一次，对比两种前端缓存
+    cout << "前端缓存模式：" << (CpuCache::Active() ? "每 CPU 缓存（rseq）" : "ThreadCache（rseq 不可用）") << endl;
+#else
+    cout << "前端缓存模式：ThreadCache" << endl;
+#endif
     BenchmarkConcurrentMalloc(n, 5, 10);    // 参数：分配/释放次数、线程数、轮数（每个线程重复 10 轮）
     cout << endl << endl;
 
     BenchmarkMalloc(n, 5, 10);  // 参数：分配/释放次数、线程数、轮数（每个线程重复 10 轮）
 
     cout << "=============================================" << endl;
+    BenchmarkProducerConsumer(n, 2, 10);    // 参数：每批对象数、生产者/消费者对数、每个生产者的批数
+
+    cout << "=============================================" << endl;
+    BenchmarkLargeLiveSet(1000000, n, 5, 10);    // 参数：常驻对象数、每轮分配/释放次数、线程数、轮数
+
+    cout << "=============================================" << endl;
+    BenchmarkBurst(256, 128, 20000, 5);    // 参数：对象大小、每批个数、批数、线程数
+
+    cout << "=============================================" << endl;
+    BenchmarkPingPong(1024, 20000, 5);    // 参数：对象大小、轮数、线程数
+
+    cout << "=============================================" << endl;
+    BenchmarkThreadChurn(n, 5, 10);    // 参数：分配/释放次数、线程数、线程创建销毁轮数
+
+    cout << "=============================================" << endl;
+
+    // 跑完之后内存池各层的状态
+    GetAllocatorStats().Print(cout);
 
     return 0;
 }
\ No newline at end of file
@@ -1,24 +1,16 @@
 ﻿#include "CentralCache.h"
 #include "PageCache.h"
-
-CentralCache CentralCache::_sInst;
+#include "AllocatorStats.h"
 
 // 获取一个非空的 Span
 Span* CentralCache::GetOneSpan(SpanList& list, size_t size)
 {
     // 先在本桶里找，有空闲就不触发 PageCache
-    // 先查看当前的 spanlist 中是否还有未分配的对象 span
-    Span* it = list.Begin();
-    while (it != list.End())
+    // 满的 span 已经被移到 _fullSpanLists，非空链表的第一个就能用，不用遍历
+    if (!list.Empty())
     {
-        if (it->_freeList != nullptr)
-        {
-            return it;
-        }
-        else
-        {
-            it = it->_next;
-        }
+        assert(list.Begin()->HasFreeObj());
+        return list.Begin();
     }
 
     // 先把桶锁解掉，避免锁住整个桶去做慢操作
@@ -31,97 +23,118 @@ Span* CentralCache::GetOneSpan(SpanList& list, size_t size)
     Span* span = PageCache::GetInstance()->NewSpan(SizeClass::NumMovePage(size));
     span->_isUse = true;
     span->objSize = size;
+    // 页表旁路记录尺寸类，ConcurrentFree 不用再读 span->objSize
+    PageCache::GetInstance()->SetSpanSizeClass(span, SizeClass::Index(size) + 1);
     PageCache::GetInstance()->_pageMtx.unlock();
     
-    // 对获取的 span 进行切分不加锁：此时还未挂回桶，其他线程看不到
-        
-    // 计算 span 的大块内存的起始地址和大块内存的大小（字节数）
+    // 不再把整个 span 预先串成自由链表：只记录未切分区域，FetchRangeObj 按批用指针运算切
+    // 这样新 span 的每一页只有真正被分出去时才会被访问
     char* start = (char*)(span->_pageId << PAGE_SHIFT);
     size_t bytes = span->_n << PAGE_SHIFT;
-    char* end = start + bytes;
-
-    // 把大块内存切成自由链表链接起来
-    // 1. 先切一块下来去做头，方便尾插
-    span->_freeList = start;
-    start += size;
-    void* tail = span->_freeList;
-    int i = 1;
-    while (start < end)
-    {
-        ++i;
-        NextObj(tail) = start;
-        tail = NextObj(tail);       // tail = satrt;
-        start += size;
-    }
+    span->_freeList = nullptr;
+    span->_bumpPtr = start;
+    // 尾部不够一个对象的零头不参与切分
+    span->_bumpEnd = start + bytes / size * size;
 
-    NextObj(tail) = nullptr;
-    
-    //// 条件断点
-    //// 疑似死循环，可以中断程序，程序会在正在运行的地方停下来
-    //int j = 0;
-    //void* cur = span->_freeList;
-    //while (cur)
-    //{
-    //    cur = NextObj(cur);
-    //    ++j;
-    //}
-    //if (j != (bytes / size))
-    //{
-    //    int x = 0;
-    //}
-
-
-    // 切好后再挂回桶，减少持锁时间
-    // 切好 span 后，需要把 span 挂到桶里面去的时候，在加锁
+    // 挂回桶的时候再加锁，减少持锁时间
     list._mtx.lock();
     list.PushFront(span);
+    ++_pageFetches[SizeClass::Index(size)];
 
     return span;
 }
 
-// 从中心缓存获取一定数量的对象给 thread cache
-size_t CentralCache::FetchRangeObj(void*& start, void*& end, size_t batchNum, size_t size)
+// 从一个 span 里取最多 n 个对象接到 [start, end] 链表后面，返回取到的个数，需持有桶锁
+size_t CentralCache::FetchFromSpan(size_t index, Span* span, void*& start, void*& end, size_t n, size_t size)
 {
-    size_t index = SizeClass::Index(size);
-    // 桶级锁：只有访问同一桶的线程才会竞争
-    _spanLists[index]._mtx.lock();
+    assert(span->HasFreeObj());
+    size_t actualNum = 0;
+
+    // 1. 先拿还回来的对象，它们大概率还在 cache 里
+    if (span->_freeList != nullptr)
+    {
+        void* first = span->_freeList;
+        void* last = first;
+        actualNum = 1;
 
-    Span* span = GetOneSpan(_spanLists[index], size);
-    assert(span);
-    assert(span->_freeList != nullptr);
+        while (actualNum < n && NextObj(last) != nullptr)
+        {
+            last = NextObj(last);
+            actualNum++;
+        }
 
-    // 从 span 中获取 batchNum 个对象
-    // 如果不够 batchNum 个，有多少拿多少
-    start = span->_freeList;
-    end = start;
-    size_t i = 0;
-    size_t actualNum = 1;
+        span->_freeList = NextObj(last);
+        NextObj(last) = nullptr;
 
-    while (i < batchNum - 1 && NextObj(end) != nullptr)
+        if (end != nullptr)
+        {
+            NextObj(end) = first;
+        }
+        else
+        {
+            start = first;
+        }
+        end = last;
+    }
+
+    // 2. 不够再从未切分区域按地址连续切一段，只访问切出来的这些对象
+    if (actualNum < n && span->_bumpPtr < span->_bumpEnd)
     {
-        end = NextObj(end);
-        i++;
-        actualNum++;
+        size_t remain = (size_t)(span->_bumpEnd - span->_bumpPtr) / size;
+        size_t cut = (std::min)(n - actualNum, remain);
+
+        char* first = span->_bumpPtr;
+        char* last = first + (cut - 1) * size;
+        for (char* obj = first; obj < last; obj += size)
+        {
+            NextObj(obj) = obj + size;
+        }
+        NextObj(last) = nullptr;
+
+        if (end != nullptr)
+        {
+            NextObj(end) = first;
+        }
+        else
+        {
+            start = first;
+        }
+        end = last;
+
+        span->_bumpPtr = last + size;
+        actualNum += cut;
     }
 
-    span->_freeList = NextObj(end);
-    NextObj(end) = nullptr;
     // 记录分配出去的数量，便于判断是否可归还 PageCache
     span->_useCount += actualNum;
 
-    //// 条件断点
-    //int j = 0;
-    //void* cur = start;
-    //while (cur)
-    //{
-	   // cur = NextObj(cur);
-	   // ++j;
-    //}
-    //if (actualNum != j)
-    //{
-	   // int x = 0;
-    //}
+    // 对象分完了就移到满链表，下次 GetOneSpan 不会再看到它
+    if (!span->HasFreeObj())
+    {
+        _spanLists[index].Erase(span);
+        _fullSpanLists[index].PushFront(span);
+    }
 
+    return actualNum;
+}
+
+// 从中心缓存获取一定数量的对象给 thread cache
+// 一个 span 不够就接着取下一个，一次凑齐 batchNum 个（批量申请接口一次可能要几百个）
+size_t CentralCache::FetchRangeObj(void*& start, void*& end, size_t batchNum, size_t size)
+{
+    size_t index = SizeClass::Index(size);
+    // 桶级锁：只有访问同一桶的线程才会竞争
+    _spanLists[index]._mtx.lock();
+
+    start = nullptr;
+    end = nullptr;
+    size_t actualNum = 0;
+    while (actualNum < batchNum)
+    {
+        Span* span = GetOneSpan(_spanLists[index], size);
+        assert(span);
+        actualNum += FetchFromSpan(index, span, start, end, batchNum - actualNum, size);
+    }
 
     _spanLists[index]._mtx.unlock();
 
@@ -129,44 +142,136 @@ size_t CentralCache::FetchRangeObj(void*& start, void*& end, size_t batchNum, si
 }
 
 
+// 归还时一次最多分组的对象个数，超过的分段处理；分组数组放在栈上，不额外分配内存
+static const size_t RELEASE_GROUP_MAX = 512;
+
 // 将一定数量的对象释放到 span 跨度中
+// 先在桶锁外按 span 分组，再在桶锁内每个 span 只更新一次
+// 空出来的 span 攒到最后，一次加 _pageMtx 统一还给 PageCache
 void CentralCache::ReleaseListToSpans(void* start, size_t size)
 {
     size_t index = SizeClass::Index(size);
-    // 桶级锁：只有访问同一桶的线程才会竞争
-    _spanLists[index]._mtx.lock();
+
+    struct ObjSpan
+    {
+        Span* _span;
+        void* _obj;
+    };
+    ObjSpan objs[RELEASE_GROUP_MAX];
+    Span* emptySpans[RELEASE_GROUP_MAX];
 
     while (start)
     {
-        void* next = NextObj(start);
+        // 1. 页表读是无锁的，查 span 不需要持有桶锁
+        size_t n = 0;
+        while (start && n < RELEASE_GROUP_MAX)
+        {
+            objs[n]._obj = start;
+            objs[n]._span = PageCache::GetInstance()->MapObjectToSpan(start);
+            start = NextObj(start);
+            ++n;
+        }
 
-        Span* span = PageCache::GetInstance()->MapObjectToSpan(start);
-        NextObj(start) = span->_freeList;
-        span->_freeList = start;
-        span->_useCount--;
+        // 2. 按 span 排序，同一个 span 的对象排在一起
+        std::sort(objs, objs + n, [](const ObjSpan& a, const ObjSpan& b) {
+            return a._span < b._span;
+        });
 
-        // 说明 span 的切出去的所有小块内存都回来了
-        // 这个 span 就可以再回去给 page cache，pagecache 可以再尝试去做前后页的合并
-        if (span->_useCount == 0)
+        // 3. 桶锁内每个 span 只接一次链表、改一次计数
+        size_t nEmpty = 0;
+        _spanLists[index]._mtx.lock();
+
+        for (size_t i = 0; i < n; )
         {
-            _spanLists[index].Erase(span);
-            span->_freeList = nullptr;
-            span->_next = nullptr;
-            span->_prev = nullptr;
+            Span* span = objs[i]._span;
+            size_t j = i + 1;
+            while (j < n && objs[j]._span == span)
+            {
+                NextObj(objs[j - 1]._obj) = objs[j]._obj;
+                ++j;
+            }
+
+            // 满 span 拿回对象，重新挂回非空链表
+            if (!span->HasFreeObj())
+            {
+                _fullSpanLists[index].Erase(span);
+                _spanLists[index].PushFront(span);
+            }
+
+            NextObj(objs[j - 1]._obj) = span->_freeList;
+            span->_freeList = objs[i]._obj;
+            span->_useCount -= (j - i);
+
+            // 说明 span 的切出去的所有小块内存都回来了
+            // 这个 span 就可以再回去给 page cache，pagecache 可以再尝试去做前后页的合并
+            if (span->_useCount == 0)
+            {
+                _spanLists[index].Erase(span);
+                span->_freeList = nullptr;
+                span->_bumpPtr = nullptr;
+                span->_bumpEnd = nullptr;
+                span->_next = nullptr;
+                span->_prev = nullptr;
+
+                emptySpans[nEmpty++] = span;
+            }
 
-            // 释放 span 给 page cache 时，使用 page cache 的锁就可以了
-            // 这时把桶锁解掉
-            _spanLists[index]._mtx.unlock();
+            i = j;
+        }
+
+        _spanLists[index]._mtx.unlock();
 
+        // 4. 释放 span 给 page cache 时，使用 page cache 的锁就可以了，整批只加一次
+        if (nEmpty > 0)
+        {
             PageCache::GetInstance()->_pageMtx.lock();
-            PageCache::GetInstance()->ReleaseSpanToPageCache(span);
+            for (size_t k = 0; k < nEmpty; ++k)
+            {
+                PageCache::GetInstance()->ReleaseSpanToPageCache(emptySpans[k]);
+            }
             PageCache::GetInstance()->_pageMtx.unlock();
+        }
+    }
+}
 
-            _spanLists[index]._mtx.lock();
+void CentralCache::CollectStats(AllocatorStats& stats)
+{
+    for (size_t i = 0; i < NFREELISTS; ++i)
+    {
+        SizeClassStats& cls = stats._classes[i];
+        size_t size = SizeClass::ClassSize(i);
+
+        std::lock_guard<std::mutex> lock(_spanLists[i]._mtx);
+        SpanList* lists[] = { &_spanLists[i], &_fullSpanLists[i] };
+        for (SpanList* list : lists)
+        {
+            for (Span* span = list->Begin(); span != list->End(); span = span->_next)
+            {
+                // 能切出的对象数和 GetOneSpan 里 _bumpEnd 的算法一致
+                size_t capacity = (span->_n << PAGE_SHIFT) / size;
+                ++cls._spans;
+                cls._spanTailBytes += (span->_n << PAGE_SHIFT) - capacity * size;
+                stats._pageHeapSpanBytes += span->_n << PAGE_SHIFT;
+                cls._inUseBytes += span->_useCount * size;
+                cls._centralCacheBytes += (capacity - span->_useCount) * size;
+            }
         }
+        cls._centralCacheMisses += _pageFetches[i];
+    }
+}
 
-        start = next;
+void CentralCache::LockAll()
+{
+    for (size_t i = 0; i < NFREELISTS; ++i)
+    {
+        _spanLists[i]._mtx.lock();
     }
+}
 
-    _spanLists[index]._mtx.unlock();
-}
\ No newline at end of file
+void CentralCache::UnlockAll()
+{
+    for (size_t i = 0; i < NFREELISTS; ++i)
+    {
+        _spanLists[i]._mtx.unlock();
+    }
+}
@@ -1,16 +1,18 @@
 ﻿#pragma once
 #include "Common.h"
 
+struct AllocatorStats;
+
 // 单例模式
 class CentralCache
 {
 public:
 	static CentralCache* GetInstance()
 	{
-		return &_sInst;
+		return LeakySingleton<CentralCache>();
 	}
 
-	// 获取一个非空的 Span
+	// 获取一个非空的 Span（O(1)：非空链表里的 span 都还有空闲对象）
 	Span* GetOneSpan(SpanList& list,size_t size);
 
 	// 从中心缓存获取一定数量的对象给 thread cache
@@ -18,9 +20,24 @@ public:
 
 	// 将一定数量的对象释放到 span 跨度中
 	void ReleaseListToSpans(void* start, size_t byte_size);
+
+	// 累加每个尺寸类的 span 个数、span 里空闲的字节数，以及分出去的字节数（记在 _inUseBytes，由调用方减去各级缓存）
+	void CollectStats(AllocatorStats& stats);
+
+	// fork 前后调用，加锁/解锁所有桶锁
+	void LockAll();
+	void UnlockAll();
 private:
+	// 从一个 span 里取最多 n 个对象接到链表后面，需持有桶锁
+	size_t FetchFromSpan(size_t index, Span* span, void*& start, void*& end, size_t n, size_t size);
+
 	// 每个桶维护自己的 SpanList，桶锁在 SpanList 内部
+	// _spanLists 只挂还有空闲对象的 span，对象被分完的 span 移到 _fullSpanLists
+	// 两个链表都由 _spanLists[i]._mtx 保护
 	SpanList _spanLists[NFREELISTS];
+	SpanList _fullSpanLists[NFREELISTS];
+	// 每个尺寸类向 PageCache 要新 span 的次数，同样由 _spanLists[i]._mtx 保护
+	size_t _pageFetches[NFREELISTS] = { 0 };
 
 private:
 	CentralCache()
@@ -29,6 +46,5 @@ private:
 	}
 
 	CentralCache(const CentralCache&) = delete;
-
-	static CentralCache _sInst;
+	friend CentralCache* LeakySingleton<CentralCache>();
 };
\ No newline at end of file
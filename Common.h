@@ -6,34 +6,337 @@
 #include <assert.h>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <cstdint>
 #include <unordered_map>
+#include <new>
 //#include <map>
 using std::cout;
 using std::endl;
 
 #ifdef _WIN32
 	#include <Windows.h>
+	#include <intrin.h>
 #else
 	// Linux
+	#include <sys/mman.h>
+	#include <unistd.h>
 #endif
 
+// 只存指针/布尔/整数的线程局部变量：跨编译单元访问 extern thread_local 时，GCC/Clang 每次要先调初始化包装函数
+// __thread 保证没有动态初始化，访问就是一次线程指针相对寻址
+#if defined(__GNUC__)
+#define TLS_POD __thread
+#else
+#define TLS_POD thread_local
+#endif
+
+// 各层单例共用：第一次用到时才构造（替换 malloc 后，其他库的全局构造可能早于本库就来申请内存），
+// 放在静态存储里用 placement new 构造、永不析构，进程退出前最后一次 free 也能用；
+// 不依赖成员（如 std::mutex）是否平凡析构，各家标准库都适用。构造函数私有的类要声明它为友元
+template <class T>
+T* LeakySingleton()
+{
+	alignas(T) static unsigned char sBuf[sizeof(T)];
+	static T* sInst = new (sBuf) T;
+	return sInst;
+}
+
 
 // 小对象上限：超过就走页级分配，避免过多小桶和碎片
 static const size_t MAX_BYTES = 256 * 1024;		// 256KB
-// 固定桶数：由对齐策略推导而来，保证 O(1) 映射
-static const size_t NFREELISTS = 208;			// 208个自由链表
 // PageCache 管理的最大页数，超出直接交给系统
 static const size_t NPAGES = 128;				// 128个页
 // 页大小固定 8KB，用移位代替乘除更快
 static const size_t PAGE_SHIFT = 13;			// 页大小为8KB
+// 页表旁路的尺寸类编码：0 表示不是小对象 span（空闲/大对象），否则为桶号 + 1
+static const size_t NO_SIZE_CLASS = 0;
+
+// 尺寸类列表：每个桶的对象大小，从小到大，查表和桶数都由它在编译期推导
+template <size_t N>
+struct SizeClassList
+{
+	size_t _sizes[N];
+};
+
+// 默认尺寸类按对齐分档生成，整体控制在最多10%左右的内存碎片浪费
+// [1,128]					8byte对齐			freelist[0,16)
+// [128+1,1024]				16byte对齐			freelist[16,72)
+// [1024+1,8*1024]			128byte对齐			freelist[72,128)
+// [8*1024+1,64*1024]		1024byte对齐			freelist[128,184)
+// [64*1024+1,256*1024]		8*1024byte对齐		freelist[184,208)
+struct SizeClassTier
+{
+	size_t _limit;		// 本档上界（含）
+	size_t _align;		// 本档对齐
+};
+
+static constexpr SizeClassTier kDefaultSizeClassTiers[] = {
+	{ 128, 8 }, { 1024, 16 }, { 8 * 1024, 128 }, { 64 * 1024, 1024 }, { 256 * 1024, 8 * 1024 },
+};
+
+constexpr size_t DefaultSizeClassCount()
+{
+	size_t count = 0;
+	size_t prev = 0;
+	for (const SizeClassTier& tier : kDefaultSizeClassTiers)
+	{
+		count += (tier._limit - prev) / tier._align;
+		prev = tier._limit;
+	}
+	return count;
+}
+
+constexpr SizeClassList<DefaultSizeClassCount()> MakeDefaultSizeClasses()
+{
+	SizeClassList<DefaultSizeClassCount()> list{};
+	size_t n = 0;
+	size_t prev = 0;
+	for (const SizeClassTier& tier : kDefaultSizeClassTiers)
+	{
+		for (size_t size = prev + tier._align; size <= tier._limit; size += tier._align)
+		{
+			list._sizes[n++] = size;
+		}
+		prev = tier._limit;
+	}
+	return list;
+}
+
+#ifdef SIZE_CLASS_TABLE
+// 按实际负载生成的尺寸类列表（SizeClassGen 输出），编译时 -DSIZE_CLASS_TABLE='"SizeClassTable.h"' 开启
+#include SIZE_CLASS_TABLE
+#else
+static constexpr SizeClassList<DefaultSizeClassCount()> kSizeClasses = MakeDefaultSizeClasses();
+#endif
+
+// 桶数：尺寸类列表的长度（默认 208 个自由链表）
+static const size_t NFREELISTS = sizeof(kSizeClasses._sizes) / sizeof(kSizeClasses._sizes[0]);
+static_assert(NFREELISTS < 256, "size class must fit in one byte");
+
+// 尺寸 -> 桶号查表：1KB 以内按 8 字节一格（下标 (size+7)>>3），1KB 以上按 128 字节一格（下标 (size+127)>>7）
+// 同一格里的尺寸必须落在同一个桶：1KB 以内的尺寸类是 8 的倍数，1KB 以上的是 128 的倍数
+static const size_t SIZE_CLASS_SMALL_MAX = 1024;
+static const size_t SIZE_CLASS_SMALL_SHIFT = 3;
+static const size_t SIZE_CLASS_LARGE_SHIFT = 7;
+
+constexpr bool SizeClassesValid()
+{
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		size_t size = kSizeClasses._sizes[i];
+		size_t align = size <= SIZE_CLASS_SMALL_MAX ? ((size_t)1 << SIZE_CLASS_SMALL_SHIFT) : ((size_t)1 << SIZE_CLASS_LARGE_SHIFT);
+		if (size % align != 0 || (i > 0 && size <= kSizeClasses._sizes[i - 1]))
+		{
+			return false;
+		}
+	}
+	return kSizeClasses._sizes[NFREELISTS - 1] == MAX_BYTES;
+}
+static_assert(SizeClassesValid(), "size classes must be ascending, aligned to the lookup granularity and end at MAX_BYTES");
+
+// 一次在 ThreadCache 和中心缓存之间移动的对象数上限：[2, 512]，小对象一批多、大对象一批少
+constexpr size_t ComputeNumMoveSize(size_t size)
+{
+	size_t num = MAX_BYTES / size;
+	if (num < 2)
+	{
+		num = 2;
+	}
+
+	if (num > 512)
+	{
+		num = 512;
+	}
+
+	return num;
+}
+
+// span 末尾装不下一个对象的字节不超过 span 的 1/SPAN_TAIL_WASTE_DIVISOR 就算合格
+static const size_t SPAN_TAIL_WASTE_DIVISOR = 128;
+
+// 按批量换算的页数：一批对象的字节数取整到页，最少 1 页
+constexpr size_t BatchSpanPages(size_t size)
+{
+	size_t npage = (ComputeNumMoveSize(size) * size) >> PAGE_SHIFT;
+	return npage == 0 ? 1 : npage;
+}
+
+// 每个尺寸类的 span 页数：在批量页数的一半到两倍之间，选末尾浪费合格、离批量页数最近的（一样近取小的，少占页堆）
+// 都不合格就取浪费比例最小的
+constexpr size_t ComputeSpanPages(size_t size)
+{
+	size_t base = BatchSpanPages(size);
+	size_t lo = (size + ((size_t)1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+	lo = lo > base / 2 ? lo : base / 2;
+	lo = lo > 0 ? lo : 1;
+	size_t hi = 2 * base < NPAGES - 1 ? 2 * base : NPAGES - 1;
+	hi = hi > base ? hi : base;
+
+	size_t best = 0;
+	size_t bestDist = 0;
+	for (size_t pages = lo; pages <= hi; ++pages)
+	{
+		size_t bytes = pages << PAGE_SHIFT;
+		size_t dist = pages > base ? pages - base : base - pages;
+		if ((bytes % size) * SPAN_TAIL_WASTE_DIVISOR <= bytes && (best == 0 || dist < bestDist))
+		{
+			best = pages;
+			bestDist = dist;
+		}
+	}
+	if (best != 0)
+	{
+		return best;
+	}
+
+	best = base;
+	for (size_t pages = lo; pages <= hi; ++pages)
+	{
+		// 浪费比例 tail/bytes 更小：交叉相乘比较，不用浮点
+		size_t tail = (pages << PAGE_SHIFT) % size;
+		size_t bestTail = (best << PAGE_SHIFT) % size;
+		if (tail * best < bestTail * pages)
+		{
+			best = pages;
+		}
+	}
+	return best;
+}
+
+struct SizeClassTables
+{
+	uint8_t _smallIndex[(SIZE_CLASS_SMALL_MAX >> SIZE_CLASS_SMALL_SHIFT) + 1];
+	uint8_t _largeIndex[(MAX_BYTES >> SIZE_CLASS_LARGE_SHIFT) + 1];
+	uint32_t _classSize[NFREELISTS];
+	uint8_t _spanPages[NFREELISTS];		// 中心缓存为这个尺寸类向 PageCache 要 span 的页数
+};
+static_assert(NPAGES - 1 <= UINT8_MAX, "span pages must fit in one byte");
+
+constexpr SizeClassTables MakeSizeClassTables()
+{
+	SizeClassTables tables{};
+
+	// 每一格取能装下这一格上界的最小尺寸类
+	size_t cls = 0;
+	for (size_t i = 0; i <= (SIZE_CLASS_SMALL_MAX >> SIZE_CLASS_SMALL_SHIFT); ++i)
+	{
+		while (kSizeClasses._sizes[cls] < (i << SIZE_CLASS_SMALL_SHIFT))
+		{
+			++cls;
+		}
+		tables._smallIndex[i] = (uint8_t)cls;
+	}
+
+	cls = 0;
+	for (size_t i = 0; i <= (MAX_BYTES >> SIZE_CLASS_LARGE_SHIFT); ++i)
+	{
+		while (kSizeClasses._sizes[cls] < (i << SIZE_CLASS_LARGE_SHIFT))
+		{
+			++cls;
+		}
+		tables._largeIndex[i] = (uint8_t)cls;
+	}
+
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		tables._classSize[i] = (uint32_t)kSizeClasses._sizes[i];
+		tables._spanPages[i] = (uint8_t)ComputeSpanPages(kSizeClasses._sizes[i]);
+	}
+	return tables;
+}
+
+static constexpr SizeClassTables kSizeClassTables = MakeSizeClassTables();
 
 #ifdef _WIN64
 	typedef unsigned long long  PAGE_ID;
 #elif _WIN32
 	typedef size_t PAGE_ID;
+#else
+	// Linux：页号宽度跟随指针宽度，32/64 位通用
+	typedef uintptr_t PAGE_ID;
 #endif
 
 
+// 透明大页大小，预留区按它对齐，THP 才能整页折叠
+static const size_t HUGEPAGE_BYTES = 2 * 1024 * 1024;			// 2MB
+// 一个大页包含的页数
+static const size_t HUGEPAGE_PAGES = HUGEPAGE_BYTES >> PAGE_SHIFT;	// 256
+
+// 大页感知模式（可选，编译期开启）：编译时定义 USE_HUGEPAGE_HEAP
+// PageCache 按整 2MB 大页向系统要内存，小 span 优先塞进已经用了一部分的大页，归还时优先还整个大页
+// 对 dTLB miss 敏感的服务更友好，代价是每次至少多占一个大页的地址空间
+
+#ifndef _WIN32
+// Linux 下一次预留的地址空间大小：大块预留，按需提交，减少 mmap 次数和 VMA 数量
+static const size_t RESERVE_CHUNK_BYTES = (size_t)1 << 30;		// 1GB
+
+// 映射一段按 align 对齐的地址空间：多映射 align 字节，再裁掉头尾
+inline void* LinuxMapAligned(size_t bytes, size_t align, int prot)
+{
+	size_t len = bytes + align;
+	void* raw = mmap(nullptr, len, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (raw == MAP_FAILED)
+	{
+		return nullptr;
+	}
+
+	uintptr_t start = (uintptr_t)raw;
+	uintptr_t aligned = (start + align - 1) & ~(uintptr_t)(align - 1);
+	if (aligned > start)
+	{
+		munmap(raw, aligned - start);
+	}
+
+	uintptr_t tail = start + len - (aligned + bytes);
+	if (tail > 0)
+	{
+		munmap((void*)(aligned + bytes), tail);
+	}
+
+	return (void*)aligned;
+}
+
+// 从预留区切一段并提交（reserve/commit），起始地址按 align 对齐（2 的幂，跳过的部分只是地址空间）
+// 非 static 的 inline 函数：各编译单元共享同一个预留区
+inline void* LinuxReserveCommit(size_t bytes, size_t align = (size_t)1 << PAGE_SHIFT)
+{
+	static std::mutex mtx;
+	static char* cur = nullptr;
+	static char* end = nullptr;
+
+	std::lock_guard<std::mutex> lock(mtx);
+
+	if (cur != nullptr)
+	{
+		cur = (char*)(((uintptr_t)cur + align - 1) & ~(uintptr_t)(align - 1));
+	}
+
+	if (cur == nullptr || cur > end || (size_t)(end - cur) < bytes)
+	{
+		// 预留区剩余不够，再预留一块；旧块尾部只是未提交的地址空间，不占物理内存
+		char* chunk = (char*)LinuxMapAligned(RESERVE_CHUNK_BYTES, HUGEPAGE_BYTES, PROT_NONE);
+		if (chunk == nullptr)
+		{
+			return nullptr;
+		}
+
+		cur = chunk;
+		end = chunk + RESERVE_CHUNK_BYTES;
+	}
+
+	// 提交：改成可读写，物理页仍在首次访问时才分配
+	char* ptr = cur;
+	if (mprotect(ptr, bytes, PROT_READ | PROT_WRITE) != 0)
+	{
+		return nullptr;
+	}
+
+	cur += bytes;
+	return ptr;
+}
+#endif
+
 
 // 直接向系统按页申请，绕过 CRT 堆锁，减少全局竞争
 inline static void* SystemAlloc(size_t kpage)
@@ -42,6 +345,23 @@ inline static void* SystemAlloc(size_t kpage)
 	void* ptr = VirtualAlloc(0, kpage << 13, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
 #else
 	// Linux
+	void* ptr = nullptr;
+	size_t bytes = kpage << PAGE_SHIFT;
+	if (kpage > NPAGES - 1)
+	{
+		// 超大块单独映射，释放时可以直接 munmap 还给系统
+		ptr = LinuxMapAligned(bytes, (size_t)1 << PAGE_SHIFT, PROT_READ | PROT_WRITE);
+	}
+	else
+	{
+		ptr = LinuxReserveCommit(bytes);
+
+		// PageCache 向系统要的 128 页大块会被切成很多小 span，提示内核用透明大页，减少 TLB miss
+		if (ptr != nullptr && kpage == NPAGES - 1)
+		{
+			madvise(ptr, bytes, MADV_HUGEPAGE);
+		}
+	}
 #endif
 
 	if (ptr == nullptr)
@@ -53,16 +373,184 @@ inline static void* SystemAlloc(size_t kpage)
 }
 
 
-inline static void SystemFree(void* ptr)
+// 按整大页申请（kpage 是 HUGEPAGE_PAGES 的倍数），起始地址按 2MB 对齐，提示内核用透明大页
+inline static void* SystemAllocHugepages(size_t kpage)
 {
+	assert(kpage % HUGEPAGE_PAGES == 0);
+	size_t bytes = kpage << PAGE_SHIFT;
+
 #ifdef _WIN32
-	VirtualFree(ptr, 0, MEM_RELEASE);
+	// VirtualAlloc 只保证 64KB 对齐：多保留一个大页，只提交对齐的那一段，多出来的只占地址空间
+	char* raw = (char*)VirtualAlloc(0, bytes + HUGEPAGE_BYTES, MEM_RESERVE, PAGE_NOACCESS);
+	void* ptr = nullptr;
+	if (raw != nullptr)
+	{
+		char* aligned = (char*)(((uintptr_t)raw + HUGEPAGE_BYTES - 1) & ~(uintptr_t)(HUGEPAGE_BYTES - 1));
+		ptr = VirtualAlloc(aligned, bytes, MEM_COMMIT, PAGE_READWRITE);
+	}
 #else
-	// Linux
+	// 太大的单独映射，不把预留区一次用掉太多
+	void* ptr = nullptr;
+	if (bytes > RESERVE_CHUNK_BYTES / 8)
+	{
+		ptr = LinuxMapAligned(bytes, HUGEPAGE_BYTES, PROT_READ | PROT_WRITE);
+	}
+	else
+	{
+		ptr = LinuxReserveCommit(bytes, HUGEPAGE_BYTES);
+	}
+
+	if (ptr != nullptr)
+	{
+		madvise(ptr, bytes, MADV_HUGEPAGE);
+	}
+#endif
+
+	if (ptr == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+
+	return ptr;
+}
+
+
+#ifdef _WIN32
+// 合并后的空闲 span 可能跨越多次 VirtualAlloc 的保留区，而 MEM_COMMIT/MEM_DECOMMIT 不能跨保留区
+// 用 VirtualQuery 按区域切开逐段处理（一个区域不会跨保留区）
+template<class Func>
+inline void ForEachSystemRegion(void* ptr, size_t bytes, Func func)
+{
+	char* cur = (char*)ptr;
+	char* end = cur + bytes;
+	while (cur < end)
+	{
+		MEMORY_BASIC_INFORMATION mbi;
+		VirtualQuery(cur, &mbi, sizeof(mbi));
+		char* regionEnd = (char*)mbi.BaseAddress + mbi.RegionSize;
+		size_t len = (size_t)((regionEnd < end ? regionEnd : end) - cur);
+		func(cur, len);
+		cur += len;
+	}
+}
+#endif
+
+
+// 归还空闲页的物理内存，地址空间保留，之后还能原地重新提交
+inline static void SystemDecommit(void* ptr, size_t kpage)
+{
+#ifdef _WIN32
+	ForEachSystemRegion(ptr, kpage << PAGE_SHIFT, [](char* p, size_t len) {
+		VirtualFree(p, len, MEM_DECOMMIT);
+	});
+#else
+	// Linux：MADV_DONTNEED 立即释放物理页，RSS 马上下降；再访问时内核给全零页
+	// 不用 MADV_FREE：它要等内存紧张才真正回收，RSS 看不出变化
+	madvise(ptr, kpage << PAGE_SHIFT, MADV_DONTNEED);
+#endif
+}
+
+// 重新提交被 SystemDecommit 过的页，分配给使用方之前调用
+inline static void SystemCommit(void* ptr, size_t kpage)
+{
+#ifdef _WIN32
+	ForEachSystemRegion(ptr, kpage << PAGE_SHIFT, [](char* p, size_t len) {
+		if (VirtualAlloc(p, len, MEM_COMMIT, PAGE_READWRITE) == nullptr)
+		{
+			throw std::bad_alloc();
+		}
+	});
+#else
+	// Linux：映射一直是可读写的，首次访问时缺页自动分配，不需要系统调用
+	(void)ptr;
+	(void)kpage;
 #endif
 }
 
 
+// 最低置位的下标（x 不能为 0），编译成一条 bsf/tzcnt 指令
+inline static size_t CountTrailingZeros(uint64_t x)
+{
+	assert(x != 0);
+#ifdef _MSC_VER
+	unsigned long idx = 0;
+#ifdef _WIN64
+	_BitScanForward64(&idx, x);
+#else
+	if ((uint32_t)x != 0)
+	{
+		_BitScanForward(&idx, (uint32_t)x);
+	}
+	else
+	{
+		_BitScanForward(&idx, (uint32_t)(x >> 32));
+		idx += 32;
+	}
+#endif
+	return idx;
+#else
+	return (size_t)__builtin_ctzll(x);
+#endif
+}
+
+
+// 定长位图：第 i 位表示第 i 个桶非空
+// 查找 >= from 的第一个非空桶只需要几次按字 find-first-set，不用逐个桶判断
+template<size_t N>
+class Bitmap
+{
+public:
+	void Set(size_t i)
+	{
+		assert(i < N);
+		_words[i >> 6] |= (uint64_t)1 << (i & 63);
+	}
+
+	void Clear(size_t i)
+	{
+		assert(i < N);
+		_words[i >> 6] &= ~((uint64_t)1 << (i & 63));
+	}
+
+	bool Test(size_t i) const
+	{
+		assert(i < N);
+		return (_words[i >> 6] >> (i & 63)) & 1;
+	}
+
+	// 返回 >= from 的第一个置位下标，没有返回 N
+	size_t FindFirstSet(size_t from) const
+	{
+		if (from >= N)
+		{
+			return N;
+		}
+
+		size_t w = from >> 6;
+		// 先屏蔽掉 from 之前的位
+		uint64_t word = _words[w] & (~(uint64_t)0 << (from & 63));
+		while (true)
+		{
+			if (word != 0)
+			{
+				size_t i = (w << 6) + CountTrailingZeros(word);
+				return i < N ? i : N;
+			}
+
+			if (++w >= WORDS)
+			{
+				return N;
+			}
+			word = _words[w];
+		}
+	}
+
+private:
+	static const size_t WORDS = (N + 63) / 64;
+	uint64_t _words[WORDS] = { 0 };
+};
+
+
 static void*& NextObj(void* obj)
 {
 	// freelist 用对象本身头部存 next 指针，省额外节点内存
@@ -85,7 +573,7 @@ public:
 		NextObj(obj) = _freeList;
 		_freeList = obj;
 
-		++_size;
+		AddSize(1);
 	}
 
 	void* Pop()
@@ -96,7 +584,7 @@ public:
 		void* obj = _freeList;
 		_freeList = NextObj(obj);
 
-		--_size;
+		SubSize(1);
 
 		return obj;
 	}
@@ -124,13 +612,13 @@ public:
 		//	int x = 0;
 		//}
 
-		_size += n;
+		AddSize(n);
 	}
 
 	void PopRange(void*& start, void*& end, size_t n)
 	{
 		// 防止 n > _size 导致越界遍历和 _size 下溢
-		assert(n <= _size);
+		assert(n <= Size());
 		// 批量摘链，配合 CentralCache 回收
 		start = _freeList;
 		end = start;
@@ -142,24 +630,42 @@ public:
 
 		_freeList = NextObj(end);
 		NextObj(end) = nullptr;
-		_size -= n;
+		SubSize(n);
 	}
 
 	size_t& MaxSize()
 	{
-		// 每个桶的“慢启动”阈值，控制批量大小
+		// 每个桶的长度上限：不到一批时兼作批量大小（慢启动），超过一批后按落空/溢出自适应
 		return _maxSize;
 	}
 
-	size_t Size()
+	size_t& Overflows()
+	{
+		// 上次落空以来连续溢出的次数，攒够了就把长度上限调小
+		return _overflows;
+	}
+
+	size_t Size() const
 	{
-		return _size;
+		return _size.load(std::memory_order_relaxed);
 	}
 
 private:
+	// _size 只有所属线程会改，统计时其他线程会读：用 relaxed 的读 + 写代替 ++，生成的指令和普通整数一样
+	void AddSize(size_t n)
+	{
+		_size.store(_size.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	void SubSize(size_t n)
+	{
+		_size.store(_size.load(std::memory_order_relaxed) - n, std::memory_order_relaxed);
+	}
+
 	void* _freeList = nullptr;
 	size_t _maxSize = 1;
-	size_t _size = 0;
+	size_t _overflows = 0;
+	std::atomic<size_t> _size{ 0 };
 };
 
 
@@ -168,12 +674,7 @@ private:
 class SizeClass
 {
 public:
-	// 整体控制在最多10%左右的内存碎片浪费
-	// [1,128]					8byte对齐			freelist[0,16)
-	// [128+1,1024]				16byte对齐			freelist[16,72)
-	// [1024+1,8*1024]			128byte对齐			freelist[72,128)
-	// [8*1024+1,64*1024]		1024byte对齐			freelist[128,184)
-	// [64*1024+1,256*1024]		8*1024byte对齐		freelist[184,208)
+	// 尺寸类见 kSizeClasses，映射全部查编译期生成的 kSizeClassTables，快路径上没有分支链
 	 
 	//size_t _RoundUp(size_t size, size_t AllgnNum)
 	//{
@@ -198,25 +699,9 @@ public:
 
 	static inline size_t RoundUp(size_t size)
 	{
-		if (size <= 128)
-		{
-			return _RoundUp(size, 8);
-		}
-		else if (size <= 1024)
+		if (size <= MAX_BYTES)
 		{
-			return _RoundUp(size, 16);
-		}
-		else if (size <= 8 * 1024)
-		{
-			return _RoundUp(size, 128);
-		}
-		else if (size <= 64 * 1024)
-		{
-			return _RoundUp(size, 1024);
-		}
-		else if (size <= 256 * 1024)
-		{
-			return _RoundUp(size, 8 * 1024);
+			return ClassSize(Index(size));
 		}
 		else
 		{
@@ -224,57 +709,24 @@ public:
 		}
 	}
 
-	//size_t _Index(size_t bytes, size_t alignNum)
-	//{
-	//	if (bytes % alignNum == 0)
-	//	{
-	//		return bytes / alignNum - 1;
-	//	}
-	//	else
-	//	{
-	//		return bytes / alignNum;
-	//	}
-	//}
-
-	static inline size_t _Index(size_t bytes, size_t alignNum)
-	{
-		// 分组映射：让桶号连续且计算 O(1)
-		return ((bytes + static_cast<size_t>((1 << alignNum) - 1)) >> alignNum) - 1;
-	}
-
 	static inline size_t Index(size_t bytes)
 	{
 		assert(bytes <= MAX_BYTES);
 
-		// 每一组桶数固定，便于算索引且控制碎片率
-		static int group_array[4] = { 16, 56, 56, 56 };
-		if (bytes <= 128)
-		{
-			return _Index(bytes, 3);
-		}
-		else if (bytes <= 1024)
-		{
-			return _Index(bytes - 128, 4) + group_array[0];
-		}
-		else if (bytes <= 8 * 1024)
-		{
-			return _Index(bytes - 1024, 7) + group_array[1] + group_array[0];
-		}
-		else if (bytes <= 64 * 1024)
-		{
-			return _Index(bytes - 8 * 1024, 10) + group_array[2] + group_array[1] + group_array[0];
-		}
-		else if (bytes <= 256 * 1024)
+		// 1KB 以内一次查 8 字节粒度的表，以上查 128 字节粒度的表
+		if (bytes <= SIZE_CLASS_SMALL_MAX)
 		{
-			return _Index(bytes - 64 * 1024, 13) + group_array[3] +
-				group_array[2] + group_array[1] + group_array[0];
-		}
-		else
-		{
-			assert(false);
+			return kSizeClassTables._smallIndex[(bytes + 7) >> SIZE_CLASS_SMALL_SHIFT];
 		}
+		return kSizeClassTables._largeIndex[(bytes + 127) >> SIZE_CLASS_LARGE_SHIFT];
+	}
 
-		return -1;
+	// Index 的逆映射：桶号 -> 该桶对象对齐后的大小
+	static inline size_t ClassSize(size_t index)
+	{
+		assert(index < NFREELISTS);
+
+		return kSizeClassTables._classSize[index];
 	}
 
 	static size_t NumMoveSize(size_t size)
@@ -289,43 +741,31 @@ public:
 		// [2, 512]，一次批量移动对象数的上限（慢启动）
 		// 小对象一次批量上限高
 		// 大对象一次批量上限低
-		size_t num = MAX_BYTES / size;
-		if (num < 2)
-		{
-			num = 2;
-		}
-
-		if (num > 512)
-		{
-			num = 512;
-		}
-
-		return num;
+		return ComputeNumMoveSize(size);
 	}
 
-	// 计算一次向系统获取几个页
+	// 计算一次向系统获取几个页：编译期按尺寸类算好，见 ComputeSpanPages
 	// 单个对象 8byte
 	// ...
 	// 单个对象 256KB
 	static size_t NumMovePage(size_t size)
 	{
-		// 把“对象数”换算成“页数”，最少 1 页
-		size_t num = NumMoveSize(size);
-
-		size_t npage = num * size;
-		npage >>= PAGE_SHIFT;
-		if (npage == 0)
-		{
-			npage = 1;
-		}
+		return kSizeClassTables._spanPages[Index(size)];
+	}
 
-		return npage;
+	// 一个 span 末尾装不下一个对象、永远用不上的字节数
+	static size_t SpanTailBytes(size_t index)
+	{
+		size_t bytes = (size_t)kSizeClassTables._spanPages[index] << PAGE_SHIFT;
+		return bytes % ClassSize(index);
 	}
 };
 
 
 
 // 管理多个连续页大块内存跨度结构
+struct StackSample;
+
 struct Span
 {
 	PAGE_ID _pageId = 0;			// 大块内存的起始页的页号
@@ -334,12 +774,32 @@ struct Span
 	Span* _next = nullptr;			// 双向链表结构
 	Span* _prev = nullptr;
 
+	Span* _left = nullptr;			// 空闲大 span 所在的 SpanTree 左右孩子
+	Span* _right = nullptr;
+
 	size_t objSize = 0;				// 切好的小块内存对象的大小
 	size_t _useCount = 0;			// 切好小块内存，被分配给 threadcache 的计数
-	void* _freeList = nullptr;		// 切好的小块内存的自由链表
+	void* _freeList = nullptr;		// 还回来的小块内存的自由链表
+
+	// 未切分区域 [_bumpPtr, _bumpEnd)：新 span 不预先串链表，按需用 bump 指针切
+	// 没用到的页不会被访问，也就不会触发缺页
+	char* _bumpPtr = nullptr;
+	char* _bumpEnd = nullptr;
 
 	// 合并时的保护标记：有线程在用就不能合并
 	bool _isUse = false;			// 是否正在被使用
+	// 空闲 span 的物理页是否还在：后台回收后为 false，再分配前要重新提交
+	// 合并只发生在状态相同的 span 之间
+	bool _isCommitted = true;
+
+	// 堆采样对象独占一个 span，这里挂着它的采样记录；普通 span 为空
+	StackSample* _sample = nullptr;
+
+	// 还有没有能分出去的对象：还回来的，或者还没切过的
+	bool HasFreeObj() const
+	{
+		return _freeList != nullptr || _bumpPtr < _bumpEnd;
+	}
 };
 
 
@@ -351,7 +811,8 @@ public:
 	SpanList()
 	{
 		// 哨兵节点：统一插删逻辑，避免空表分支
-		_head = new Span;
+		// 哨兵直接内嵌，构造时不申请内存：替换 malloc 后，单例构造不能再回调内存池自己
+		_head = &_sentinel;
 		_head->_next = _head;
 		_head->_prev = _head;
 	}
@@ -418,6 +879,7 @@ public:
 	}
 
 private:
+	Span _sentinel;
 	Span* _head = nullptr;
 public:
 	std::mutex _mtx;			// 桶锁
@@ -2,65 +2,438 @@
 #include "Common.h"
 #include "ThreadCache.h"
 #include "PageCache.h"
+#include "CpuCache.h"
+#include "TransferCache.h"
+#include "CentralCache.h"
+#include "AllocatorStats.h"
+#include "HeapProfiler.h"
+#include "AllocTrace.h"
+#include <cstring>
 
-// 统一获取线程私有缓存：避免跨线程共享导致锁竞争
-static ThreadCache* GetThreadCache()
+// 本线程第一次用到内存池：构造线程私有缓存
+// 线程退出、ThreadCache 已析构后返回 nullptr，调用方改走 *WithoutCache
+static ThreadCache* InitThreadCache()
 {
     // 使用 thread_local 保证线程局部存储初始化一致，避免并发下的对象池竞争
-    if (pTLSThreadCache == nullptr)
+    // thread_local 对象的析构就是线程退出钩子：~ThreadCache 会把缓存的对象全部还回去
+    // 构造期间的重入（替换 malloc 后 C 库登记析构钩子会调 calloc）返回 nullptr，走无缓存路径
+    if (!tlsThreadCacheDestroyed && !tlsThreadCacheInitializing)
     {
+        tlsThreadCacheInitializing = true;
         thread_local ThreadCache tc;
         pTLSThreadCache = &tc;
+        tlsThreadCacheInitializing = false;
     }
 
     return pTLSThreadCache;
 }
 
+// 统一获取线程私有缓存：避免跨线程共享导致锁竞争
+// 快路径只读一次线程局部指针，函数局部 thread_local 的初始化检查放在 InitThreadCache 里
+static inline ThreadCache* GetThreadCache()
+{
+    ThreadCache* tc = pTLSThreadCache;
+    if (tc != nullptr)
+    {
+        return tc;
+    }
+
+    return InitThreadCache();
+}
+
+// 大对象的堆采样计数：每 CPU 缓存生效时用它的线程局部计数，不为了采样给每个线程构造 ThreadCache
+static inline bool PickLargeSample(size_t size)
+{
+#ifdef PERCPU_CACHE_ENABLED
+	if (CpuCache::Active())
+	{
+		return CpuCache::PickSample(size);
+	}
+#endif
+
+	ThreadCache* tc = GetThreadCache();
+	return tc != nullptr && tc->PickSample(size);
+}
+
 // 对外统一入口：小对象走线程缓存，大对象走页级分配
 static void* ConcurrentAlloc(size_t size)
 {
 	if (size > MAX_BYTES)
 	{
+		// 堆采样：大对象同样计入采样字节数
+		if (PickLargeSample(size))
+		{
+			void* ptr = HeapProfiler::GetInstance()->AllocateSampled(size);
+			if (ptr != nullptr)
+			{
+				return TraceAlloc(ptr, size);
+			}
+		}
+
 		// 大对象按页对齐，减少系统碎片
 		size_t alignedSize = SizeClass::RoundUp(size);
 		size_t kpage = alignedSize >> PAGE_SHIFT;
 
 		// PageCache 是全局共享资源，需要加锁保护
-		PageCache::GetInstance()->_pageMtx.lock();
-		Span* span = PageCache::GetInstance()->NewSpan(kpage);
-		span->objSize = size;
-		span->_isUse = true; // 防止大对象 span 被误合并
-		PageCache::GetInstance()->_pageMtx.unlock();
+		// 向系统要不到内存时 NewSpan 抛 bad_alloc，用 lock_guard 保证锁被释放
+		Span* span = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(PageCache::GetInstance()->_pageMtx);
+			span = PageCache::GetInstance()->NewSpan(kpage);
+			span->objSize = size;
+			span->_isUse = true; // 防止大对象 span 被误合并
+		}
 
 		void* ptr = (void*)(span->_pageId << PAGE_SHIFT);
-		return ptr;
+		return TraceAlloc(ptr, size);
 	}
 	else
 	{
+#ifdef PERCPU_CACHE_ENABLED
+		// 每 CPU 缓存模式：用 rseq 在当前核的 slab 上分配，不经过 ThreadCache
+		if (CpuCache::Active())
+		{
+			return TraceAlloc(CpuCache::GetInstance()->Allocate(size), size);
+		}
+#endif
+
 		// 小对象直接走线程缓存，尽量不加锁
 		// 每个线程无锁的获取自己专属的 ThreadCache 对象
-		return GetThreadCache()->Allocate(size);
+		ThreadCache* tc = GetThreadCache();
+		if (tc == nullptr)
+		{
+			return TraceAlloc(ThreadCache::AllocateWithoutCache(size), size);
+		}
+
+		return TraceAlloc(tc->Allocate(size), size);
+
+	}
+}
+
+// 按 alignment（2 的幂）对齐申请，用 ConcurrentFree 释放（不能用 ConcurrentFreeSized）
+// 不超过一页的对齐：挑对象大小是 alignment 倍数的最小尺寸类，span 起始按页对齐，其中每个对象天然对齐
+// 更大的对齐（或者没有合适的尺寸类）：向 PageCache 要起始页对齐的 span，多切的页当场还回去
+static void* ConcurrentAllocAligned(size_t size, size_t alignment)
+{
+	assert(alignment > 0 && (alignment & (alignment - 1)) == 0);
+
+	if (alignment <= ((size_t)1 << PAGE_SHIFT) && size <= MAX_BYTES)
+	{
+		for (size_t index = SizeClass::Index(size == 0 ? 1 : size); index < NFREELISTS; ++index)
+		{
+			size_t classSize = SizeClass::ClassSize(index);
+			if (classSize % alignment == 0)
+			{
+				return ConcurrentAlloc(classSize);
+			}
+		}
+	}
+
+	size_t kpage = SizeClass::_RoundUp(size == 0 ? 1 : size, (size_t)1 << PAGE_SHIFT) >> PAGE_SHIFT;
+	size_t alignPages = (std::max)(alignment >> PAGE_SHIFT, (size_t)1);
+
+	Span* span = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(PageCache::GetInstance()->_pageMtx);
+		span = PageCache::GetInstance()->NewAlignedSpan(kpage, alignPages);
+		span->objSize = size;
+		span->_isUse = true;
+	}
+
+	return TraceAlloc((void*)(span->_pageId << PAGE_SHIFT), size);
+}
+
+// 小对象释放：优先还到本线程缓存
+static void ConcurrentFreeSmall(void* ptr, size_t size)
+{
+	TraceFree(ptr, size);
 
+#ifdef PERCPU_CACHE_ENABLED
+	if (CpuCache::Active())
+	{
+		CpuCache::GetInstance()->Deallocate(ptr, size);
+		return;
+	}
+#endif
+
+	ThreadCache* tc = GetThreadCache();
+	if (tc == nullptr)
+	{
+		ThreadCache::DeallocateWithoutCache(ptr, size);
+		return;
 	}
+
+	tc->Deallocate(ptr, size);
+}
+
+// 大对象（以及堆采样对象、超过一页对齐的对象）释放：直接归还给 PageCache，再由其合并
+static void ConcurrentFreeLarge(void* ptr)
+{
+	Span* span = PageCache::GetInstance()->MapObjectToSpan(ptr);
+	assert(span->_isUse);
+	TraceFree(ptr, span->objSize);
+
+	if (span->_sample != nullptr)
+	{
+		HeapProfiler::GetInstance()->RemoveSample(span);
+	}
+
+	PageCache::GetInstance()->_pageMtx.lock();
+	PageCache::GetInstance()->ReleaseSpanToPageCache(span);
+	PageCache::GetInstance()->_pageMtx.unlock();
 }
 
 // 与 ConcurrentAlloc 配套释放，必须传入原始指针
 static void ConcurrentFree(void* ptr)
 {
-	Span* span = PageCache::GetInstance()->MapObjectToSpan(ptr);
-	size_t size = span->objSize;
+	// 先查页表旁路的尺寸类：小对象不用访问 Span，省一次冷元数据的 cache miss
+	size_t sizeClass = PageCache::GetInstance()->MapObjectToSizeClass(ptr);
+
+	if (sizeClass != NO_SIZE_CLASS)
+	{
+		// 小对象回收到线程缓存，降低锁开销
+		// free 路径也需要保证初始化
+		ConcurrentFreeSmall(ptr, SizeClass::ClassSize(sizeClass - 1));
+	}
+	else
+	{
+		ConcurrentFreeLarge(ptr);
+	}
+}
 
+// 带大小的释放（可对接 C++14 sized delete）：size 必须是申请时传给 ConcurrentAlloc 的大小
+// 小对象直接由 size 算出桶号，连页表都不用查
+static void ConcurrentFreeSized(void* ptr, size_t size)
+{
 	if (size > MAX_BYTES)
 	{
-		// 大对象直接归还给 PageCache，再由其合并
-		PageCache::GetInstance()->_pageMtx.lock();
-		PageCache::GetInstance()->ReleaseSpanToPageCache(span);
-		PageCache::GetInstance()->_pageMtx.unlock();
+		ConcurrentFreeLarge(ptr);
+	}
+	else if (HeapProfiler::MayHaveSamples())
+	{
+		// 开过堆采样：小对象也可能是单独分配的采样对象，只能查页表
+		ConcurrentFree(ptr);
 	}
 	else
 	{
-		// 小对象回收到线程缓存，降低锁开销
-		// free 路径也需要保证初始化
-		GetThreadCache()->Deallocate(ptr, size);
+		assert(PageCache::GetInstance()->MapObjectToSizeClass(ptr) == SizeClass::Index(size) + 1);
+		ConcurrentFreeSmall(ptr, size);
 	}
-}
\ No newline at end of file
+}
+
+// 批量申请 n 个大小为 size 的对象，写到 out[0..n)，释放方式和 ConcurrentAlloc 的一样
+// 尺寸类只算一次，本地链表直接弹，不够的部分一次向中心缓存要齐，不用每个对象都走一遍慢路径
+static void ConcurrentAllocBatch(size_t size, size_t n, void** out)
+{
+	if (size > MAX_BYTES)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			out[i] = ConcurrentAlloc(size);
+		}
+		return;
+	}
+
+#ifdef PERCPU_CACHE_ENABLED
+	if (CpuCache::Active())
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			out[i] = TraceAlloc(CpuCache::GetInstance()->Allocate(size), size);
+		}
+		return;
+	}
+#endif
+
+	ThreadCache* tc = GetThreadCache();
+	if (tc == nullptr)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			out[i] = TraceAlloc(ThreadCache::AllocateWithoutCache(size), size);
+		}
+		return;
+	}
+
+	tc->AllocateBatch(size, n, out);
+	for (size_t i = 0; i < n; ++i)
+	{
+		TraceAlloc(out[i], size);
+	}
+}
+
+// 一段同尺寸类的小对象整段还给缓存
+static void ConcurrentFreeSmallBatch(void** ptrs, size_t n, size_t size)
+{
+	for (size_t i = 0; i < n; ++i)
+	{
+		TraceFree(ptrs[i], size);
+	}
+
+#ifdef PERCPU_CACHE_ENABLED
+	if (CpuCache::Active())
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			CpuCache::GetInstance()->Deallocate(ptrs[i], size);
+		}
+		return;
+	}
+#endif
+
+	ThreadCache* tc = GetThreadCache();
+	if (tc == nullptr)
+	{
+		ThreadCache::DeallocateBatchWithoutCache(ptrs, n, size);
+		return;
+	}
+
+	tc->DeallocateBatch(ptrs, n, size);
+}
+
+// 批量释放 n 个对象，大小可以不同；相邻的同尺寸类对象合成一段一次还回去
+static void ConcurrentFreeBatch(void** ptrs, size_t n)
+{
+	size_t i = 0;
+	size_t sizeClass = n > 0 ? PageCache::GetInstance()->MapObjectToSizeClass(ptrs[0]) : NO_SIZE_CLASS;
+	while (i < n)
+	{
+		// 每个对象只查一次页表：找段尾时查到的下一个对象的尺寸类留给下一段用
+		size_t j = i + 1;
+		size_t nextClass = NO_SIZE_CLASS;
+		while (j < n)
+		{
+			nextClass = PageCache::GetInstance()->MapObjectToSizeClass(ptrs[j]);
+			if (sizeClass == NO_SIZE_CLASS || nextClass != sizeClass)
+			{
+				break;
+			}
+			++j;
+		}
+
+		if (sizeClass == NO_SIZE_CLASS)
+		{
+			ConcurrentFreeLarge(ptrs[i]);
+		}
+		else
+		{
+			ConcurrentFreeSmallBatch(ptrs + i, j - i, SizeClass::ClassSize(sizeClass - 1));
+		}
+
+		i = j;
+		sizeClass = nextClass;
+	}
+}
+
+// 调整对象大小，语义同 realloc：ptr 为空等同 ConcurrentAlloc，newSize 为 0 等同 ConcurrentFree 并返回 nullptr
+// 返回的指针可能和 ptr 不同；原地缩小后尺寸类和 newSize 对不上，之后用 ConcurrentFree 释放
+// 小对象：新大小还在原尺寸类里（缩小时不低于一半）直接返回原指针
+// 大对象：原地伸缩 span，缩小时把尾部页还回去，变大时吞掉后面紧挨着的空闲页；都不行才申请新的再拷贝
+static void* ConcurrentRealloc(void* ptr, size_t newSize)
+{
+	if (ptr == nullptr)
+	{
+		return ConcurrentAlloc(newSize);
+	}
+	if (newSize == 0)
+	{
+		ConcurrentFree(ptr);
+		return nullptr;
+	}
+
+	size_t oldSize = 0;
+	size_t sizeClass = PageCache::GetInstance()->MapObjectToSizeClass(ptr);
+	if (sizeClass != NO_SIZE_CLASS)
+	{
+		oldSize = SizeClass::ClassSize(sizeClass - 1);
+		if (newSize <= oldSize && (newSize >= oldSize / 2 || SizeClass::RoundUp(newSize) == oldSize))
+		{
+			// 轨迹里原地调整记成释放再申请同一地址，重放时照样是一次换大小
+			TraceFree(ptr, oldSize);
+			return TraceAlloc(ptr, newSize);
+		}
+	}
+	else
+	{
+		Span* span = PageCache::GetInstance()->MapObjectToSpan(ptr);
+		oldSize = span->objSize;
+
+		// 采样对象记录着申请时的大小，不原地改；缩到小对象范围也要换成尺寸类对象，ConcurrentFreeSized 才认得
+		if (span->_sample == nullptr && newSize > MAX_BYTES)
+		{
+			size_t kpage = SizeClass::RoundUp(newSize) >> PAGE_SHIFT;
+			bool resized = false;
+			{
+				std::lock_guard<std::mutex> lock(PageCache::GetInstance()->_pageMtx);
+				if (PageCache::GetInstance()->ResizeSpan(span, kpage))
+				{
+					span->objSize = newSize;
+					resized = true;
+				}
+			}
+			if (resized)
+			{
+				TraceFree(ptr, oldSize);
+				return TraceAlloc(ptr, newSize);
+			}
+		}
+	}
+
+	void* newPtr = ConcurrentAlloc(newSize);
+	memcpy(newPtr, ptr, (std::min)(oldSize, newSize));
+	ConcurrentFree(ptr);
+	return newPtr;
+}
+
+// 立即把空闲内存还给系统：适合流量高峰过后手动调用
+// 先清空中转缓存，让整批暂存的对象回到 span，空出来的 span 再回到 PageCache，最后归还全部空闲页
+// 返回归还的字节数；各线程/各 CPU 缓存里的对象不受影响
+static size_t ConcurrentReleaseFreeMemory()
+{
+	TransferCache::GetInstance()->Flush();
+
+	std::lock_guard<std::mutex> lock(PageCache::GetInstance()->_pageMtx);
+	return PageCache::GetInstance()->ReleaseAtMost(SIZE_MAX);
+}
+
+// 后台按速率归还空闲页（字节/秒），0 表示暂停
+// 速率限制避免刚释放又马上要用的内存被反复归还、缺页
+static void ConcurrentSetReleaseRate(size_t bytesPerSecond)
+{
+	PageCache::GetInstance()->SetReleaseRate(bytesPerSecond);
+}
+
+// 所有线程缓存合计最多缓存 bytes 字节（默认 32MB），线程缓存不够用时从别的线程那里偷上限
+// 调小后各线程在下一次慢路径上收缩；每个线程至少保留 THREAD_CACHE_MIN_BYTES
+static void ConcurrentSetThreadCacheBudget(size_t bytes)
+{
+	ThreadCache::SetOverallBudget(bytes);
+}
+
+// 堆采样：平均每申请 bytes 字节（随机）采一次，记录调用栈和大小，0 表示关闭
+// 采样对象单独占页，间隔越小开销和内存浪费越大，线上一般用 MB 级
+static void ConcurrentSetProfileSampleRate(size_t bytes)
+{
+	HeapProfiler::GetInstance()->SetSampleRate(bytes);
+}
+
+// 输出存活采样按调用栈汇总的报告：估算每个调用栈当前占用的字节数和对象数，从大到小
+static void ConcurrentDumpHeapProfile(std::ostream& os)
+{
+	HeapProfiler::GetInstance()->Dump(os);
+}
+
+#ifdef ALLOC_TRACE_ENABLED
+// 申请/释放轨迹（编译时定义 USE_ALLOC_TRACE）：开始把每次申请、释放记录到 path，打不开文件返回 false
+// 记录线程号、大小、对象地址和时间戳，用 TraceReplay 按原来的线程数重放到内存池或系统 malloc 上
+static bool ConcurrentStartTrace(const char* path)
+{
+	return AllocTrace::GetInstance()->Start(path);
+}
+
+// 结束记录并写完文件，返回记录条数
+static size_t ConcurrentStopTrace()
+{
+	return AllocTrace::GetInstance()->Stop();
+}
+#endif
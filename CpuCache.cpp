@@ -0,0 +1,154 @@
+﻿#include "CpuCache.h"
+#include "CentralCache.h"
+#include "TransferCache.h"
+#include "AllocatorStats.h"
+
+#ifdef PERCPU_CACHE_ENABLED
+#include <sys/sysinfo.h>
+#include <cstring>
+
+TLS_POD int64_t tlsCpuBytesUntilSample = 0;
+TLS_POD uint64_t tlsCpuSampleRng = 0;
+
+bool CpuCache::ResetSampleCounter()
+{
+	if (tlsCpuSampleRng == 0)
+	{
+		// 各线程的随机数种子不同，采样点就不会在线程间同步
+		tlsCpuSampleRng = (uint64_t)(uintptr_t)&tlsCpuSampleRng * 0x9E3779B97F4A7C15ull + (uint64_t)time(nullptr);
+		tlsCpuSampleRng |= 1;
+	}
+
+	tlsCpuBytesUntilSample = HeapProfiler::GetInstance()->NextSampleInterval(tlsCpuSampleRng);
+	return HeapProfiler::GetInstance()->SampleRate() != 0;
+}
+
+CpuSlab* CpuCache::InitSlabs()
+{
+	std::lock_guard<std::mutex> lock(_initMtx);
+
+	CpuSlab* slabs = _slabs.load(std::memory_order_relaxed);
+	if (slabs != nullptr)
+	{
+		return slabs;
+	}
+
+	// 容量按字节上限换算：小对象多缓存几个，大对象少缓存，至少 1 个
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		size_t cap = PERCPU_CLASS_BYTES / SizeClass::ClassSize(i);
+		cap = (std::max)(cap, (size_t)1);
+		cap = (std::min)(cap, PERCPU_MAX_SLOTS);
+		_capacity[i] = cap;
+	}
+
+	// 按可能出现的 CPU 个数分配，槽位只在用到时才真正占物理页
+	_numCpus = (size_t)get_nprocs_conf();
+	size_t bytes = SizeClass::_RoundUp(_numCpus * sizeof(CpuSlab), 1 << PAGE_SHIFT);
+	slabs = (CpuSlab*)SystemAlloc(bytes >> PAGE_SHIFT);
+	memset((void*)slabs, 0, _numCpus * sizeof(CpuSlab));
+
+	_slabs.store(slabs, std::memory_order_release);
+	return slabs;
+}
+
+void* CpuCache::Refill(size_t index, size_t alignSize)
+{
+	CpuSlab* slabs = _slabs.load(std::memory_order_acquire);
+	if (slabs == nullptr)
+	{
+		slabs = InitSlabs();
+	}
+
+	_misses[index].fetch_add(1, std::memory_order_relaxed);
+
+	// 一次补半个容量，既减少进中心缓存的次数，又给随后的释放留出空位
+	size_t batchNum = (std::max)(_capacity[index] / 2, (size_t)1);
+	batchNum = (std::min)(batchNum, SizeClass::NumMoveSize(alignSize));
+
+	void* start = nullptr;
+	void* end = nullptr;
+	size_t actualNum = TransferCache::GetInstance()->RemoveRange(index, start, end, batchNum);
+	if (actualNum == 0)
+	{
+		actualNum = CentralCache::GetInstance()->FetchRangeObj(start, end, batchNum, alignSize);
+	}
+	assert(actualNum > 0);
+	(void)actualNum;
+
+	// 第一个返回给调用方，其余压进当前 CPU；中途被别的线程填满就把剩下的还回去
+	void* result = start;
+	void* cur = NextObj(start);
+	while (cur != nullptr)
+	{
+		void* next = NextObj(cur);
+		if (!Push(slabs, index, cur))
+		{
+			CentralCache::GetInstance()->ReleaseListToSpans(cur, alignSize);
+			break;
+		}
+		cur = next;
+	}
+
+	return result;
+}
+
+void CpuCache::Drain(size_t index, size_t size, void* ptr)
+{
+	CpuSlab* slabs = _slabs.load(std::memory_order_acquire);
+	if (slabs == nullptr)
+	{
+		slabs = InitSlabs();
+	}
+
+	_misses[index].fetch_add(1, std::memory_order_relaxed);
+
+	// 弹出半个容量，连同 ptr 串成链表一次还给中心缓存
+	size_t drainNum = (std::max)(_capacity[index] / 2, (size_t)1);
+	NextObj(ptr) = nullptr;
+	void* start = ptr;
+	void* end = ptr;
+	size_t n = 1;
+	for (size_t i = 0; i < drainNum; ++i)
+	{
+		void* obj = Pop(slabs, index);
+		if (obj == nullptr)
+		{
+			break;
+		}
+
+		NextObj(obj) = start;
+		start = obj;
+		++n;
+	}
+
+	if (!TransferCache::GetInstance()->InsertRange(index, start, end, n))
+	{
+		CentralCache::GetInstance()->ReleaseListToSpans(start, size);
+	}
+}
+
+void CpuCache::CollectStats(AllocatorStats& stats)
+{
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		stats._classes[i]._threadCacheMisses += _misses[i].load(std::memory_order_relaxed);
+	}
+
+	CpuSlab* slabs = _slabs.load(std::memory_order_acquire);
+	if (slabs == nullptr)
+	{
+		return;
+	}
+
+	// 计数由各 CPU 在 rseq 临界区里写，这里只做一次原子读
+	for (size_t cpu = 0; cpu < _numCpus; ++cpu)
+	{
+		for (size_t i = 0; i < NFREELISTS; ++i)
+		{
+			uint64_t count = __atomic_load_n(&slabs[cpu]._count[i], __ATOMIC_RELAXED);
+			stats._classes[i]._threadCacheBytes += count * SizeClass::ClassSize(i);
+		}
+	}
+}
+#endif
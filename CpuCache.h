@@ -0,0 +1,245 @@
+﻿#pragma once
+#include "Common.h"
+#include "HeapProfiler.h"
+
+// 每 CPU 缓存（可选，编译期开启）：用 Linux restartable sequences（rseq）实现
+// 编译时定义 USE_PERCPU_CACHE 开启，只支持 x86_64 Linux；未开启或内核/glibc 不支持 rseq 时仍走 ThreadCache
+// 线程很多但大多空闲时，缓存按核数而不是线程数占用内存
+#if defined(USE_PERCPU_CACHE) && defined(__linux__) && defined(__x86_64__)
+#define PERCPU_CACHE_ENABLED 1
+#endif
+
+#ifdef PERCPU_CACHE_ENABLED
+#include <sys/rseq.h>
+#include <cstddef>
+
+struct AllocatorStats;
+
+// 每 CPU 缓存模式下的堆采样计数：小对象和大对象都不经过 ThreadCache，计数放在线程局部变量里
+// 距离下一次采样还要申请的字节数，以及抽间隔用的随机数状态（0 表示还没播种）
+extern TLS_POD int64_t tlsCpuBytesUntilSample;
+extern TLS_POD uint64_t tlsCpuSampleRng;
+
+// 每个尺寸类在每个 CPU 上最多缓存的对象个数（槽位固定，容量按对象大小再收紧）
+static const size_t PERCPU_MAX_SLOTS = 128;
+// 每个尺寸类在每个 CPU 上最多缓存的字节数，决定实际容量
+static const size_t PERCPU_CLASS_BYTES = 32 * 1024;
+
+// 一个 CPU 的 slab：计数和槽位放在一起，rseq 临界区里用“基址 + cpu * 步长”定位
+struct CpuSlab
+{
+	uint64_t _count[NFREELISTS];						// 每个尺寸类当前缓存的对象个数
+	void* _slots[NFREELISTS][PERCPU_MAX_SLOTS];		// 栈式槽位，_count 指向栈顶
+};
+
+// 单例模式
+class CpuCache
+{
+public:
+	static CpuCache* GetInstance()
+	{
+		return LeakySingleton<CpuCache>();
+	}
+
+	// 当前线程是否可以用每 CPU 缓存（glibc 已注册 rseq）
+	static bool Active()
+	{
+		return __rseq_size > 0;
+	}
+
+	void* Allocate(size_t size)
+	{
+		assert(size <= MAX_BYTES);
+
+		// 堆采样：采中的对象单独分配，和 ThreadCache 一样
+		if (PickSample(size))
+		{
+			void* ptr = HeapProfiler::GetInstance()->AllocateSampled(size);
+			if (ptr != nullptr)
+			{
+				return ptr;
+			}
+		}
+
+		size_t index = SizeClass::Index(size);
+		CpuSlab* slabs = _slabs.load(std::memory_order_acquire);
+		if (slabs != nullptr)
+		{
+			void* obj = Pop(slabs, index);
+			if (obj != nullptr)
+			{
+				return obj;
+			}
+		}
+
+		// 当前 CPU 没货，批量向中心缓存要
+		return Refill(index, SizeClass::RoundUp(size));
+	}
+
+	void Deallocate(void* ptr, size_t size)
+	{
+		assert(ptr);
+		assert(size <= MAX_BYTES);
+
+		size_t index = SizeClass::Index(size);
+		CpuSlab* slabs = _slabs.load(std::memory_order_acquire);
+		if (slabs != nullptr && Push(slabs, index, ptr))
+		{
+			return;
+		}
+
+		// 当前 CPU 满了，连同 ptr 一起还一批给中心缓存
+		Drain(index, size, ptr);
+	}
+
+	// 堆采样计数：平均每申请 N 字节返回一次 true；没采中时只是一次减法和一次判断
+	// 大对象也用它计数，每 CPU 缓存模式下不用为了采样构造 ThreadCache
+	static bool PickSample(size_t size)
+	{
+		tlsCpuBytesUntilSample -= (int64_t)size;
+		return tlsCpuBytesUntilSample < 0 && ResetSampleCounter();
+	}
+
+	// fork 前后调用：别的线程正在 InitSlabs 时 fork，子进程里初始化锁不能一直被占着
+	void LockAll() { _initMtx.lock(); }
+	void UnlockAll() { _initMtx.unlock(); }
+
+	// 累加各 CPU 缓存的字节数（记在前端缓存一栏）和慢路径次数
+	void CollectStats(AllocatorStats& stats);
+
+private:
+	// 当前线程的 rseq 注册区，由 glibc 在线程创建时注册
+	static struct rseq* RseqArea()
+	{
+		return (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+	}
+
+	// 在当前 CPU 的 slab 上弹出一个对象：无锁、无原子指令
+	// 临界区被抢占/迁移/信号打断时，内核跳到 abort，重新读 cpu 再来一次
+	// 返回 nullptr 表示当前 CPU 这个尺寸类没有缓存
+	void* Pop(CpuSlab* slabs, size_t index)
+	{
+		struct rseq* rs = RseqArea();
+		size_t slotOffset = offsetof(CpuSlab, _slots) + index * PERCPU_MAX_SLOTS * sizeof(void*);
+		size_t stride = sizeof(CpuSlab);
+		void* result = nullptr;
+
+	retry:
+		asm volatile goto(
+			".pushsection __rseq_cs, \"aw\"\n\t"
+			".balign 32\n\t"
+			"3:\n\t"
+			".long 0x0, 0x0\n\t"
+			".quad 1f, (2f - 1f), 4f\n\t"
+			".popsection\n\t"
+			".pushsection __rseq_failure, \"ax\"\n\t"
+			".byte 0x0f, 0xb9, 0x3d\n\t"
+			".long 0x53053053\n\t"				// RSEQ_SIG
+			"4:\n\t"
+			"jmp %l[abort]\n\t"
+			".popsection\n\t"
+			"leaq 3b(%%rip), %%rax\n\t"
+			"movq %%rax, 8(%[rs])\n\t"			// rs->rseq_cs = &cs
+			"1:\n\t"
+			"movl 4(%[rs]), %%eax\n\t"			// cpu = rs->cpu_id
+			"imulq %[stride], %%rax\n\t"
+			"addq %[slabs], %%rax\n\t"			// slab = slabs + cpu
+			"movq (%%rax, %[index], 8), %%rcx\n\t"
+			"testq %%rcx, %%rcx\n\t"
+			"jz %l[empty]\n\t"
+			"subq $1, %%rcx\n\t"
+			"leaq (%%rax, %[slotOffset]), %%rdx\n\t"
+			"movq (%%rdx, %%rcx, 8), %%rdx\n\t"
+			"movq %%rdx, (%[result])\n\t"
+			"movq %%rcx, (%%rax, %[index], 8)\n\t"	// 提交：count - 1
+			"2:\n\t"
+			:
+			: [rs] "r"(rs), [slabs] "r"(slabs), [index] "r"(index),
+			  [slotOffset] "r"(slotOffset), [stride] "r"(stride), [result] "r"(&result)
+			: "rax", "rcx", "rdx", "cc", "memory"
+			: abort, empty);
+		return result;
+
+	abort:
+		goto retry;
+
+	empty:
+		return nullptr;
+	}
+
+	// 在当前 CPU 的 slab 上压入一个对象，满了返回 false
+	bool Push(CpuSlab* slabs, size_t index, void* obj)
+	{
+		struct rseq* rs = RseqArea();
+		size_t slotOffset = offsetof(CpuSlab, _slots) + index * PERCPU_MAX_SLOTS * sizeof(void*);
+		size_t stride = sizeof(CpuSlab);
+		size_t capacity = _capacity[index];
+
+	retry:
+		asm volatile goto(
+			".pushsection __rseq_cs, \"aw\"\n\t"
+			".balign 32\n\t"
+			"3:\n\t"
+			".long 0x0, 0x0\n\t"
+			".quad 1f, (2f - 1f), 4f\n\t"
+			".popsection\n\t"
+			".pushsection __rseq_failure, \"ax\"\n\t"
+			".byte 0x0f, 0xb9, 0x3d\n\t"
+			".long 0x53053053\n\t"				// RSEQ_SIG
+			"4:\n\t"
+			"jmp %l[abort]\n\t"
+			".popsection\n\t"
+			"leaq 3b(%%rip), %%rax\n\t"
+			"movq %%rax, 8(%[rs])\n\t"			// rs->rseq_cs = &cs
+			"1:\n\t"
+			"movl 4(%[rs]), %%eax\n\t"			// cpu = rs->cpu_id
+			"imulq %[stride], %%rax\n\t"
+			"addq %[slabs], %%rax\n\t"			// slab = slabs + cpu
+			"movq (%%rax, %[index], 8), %%rcx\n\t"
+			"cmpq %[capacity], %%rcx\n\t"
+			"jae %l[full]\n\t"
+			"leaq (%%rax, %[slotOffset]), %%rdx\n\t"
+			"movq %[obj], (%%rdx, %%rcx, 8)\n\t"
+			"addq $1, %%rcx\n\t"
+			"movq %%rcx, (%%rax, %[index], 8)\n\t"	// 提交：count + 1
+			"2:\n\t"
+			:
+			: [rs] "r"(rs), [slabs] "r"(slabs), [index] "r"(index),
+			  [slotOffset] "r"(slotOffset), [stride] "r"(stride),
+			  [capacity] "r"(capacity), [obj] "r"(obj)
+			: "rax", "rcx", "rdx", "cc", "memory"
+			: abort, full);
+		return true;
+
+	abort:
+		goto retry;
+
+	full:
+		return false;
+	}
+
+	// 计数器用完：重新抽下一次的间隔，返回采样是否打开
+	static bool ResetSampleCounter();
+
+	// 第一次使用时按 CPU 个数分配 slab
+	CpuSlab* InitSlabs();
+
+	// 慢路径：向中心缓存批量取，留一个返回，其余压进当前 CPU
+	void* Refill(size_t index, size_t alignSize);
+
+	// 慢路径：从当前 CPU 弹出一批，连同 ptr 一起还给中心缓存
+	void Drain(size_t index, size_t size, void* ptr);
+
+private:
+	std::atomic<CpuSlab*> _slabs{ nullptr };
+	size_t _numCpus = 0;
+	size_t _capacity[NFREELISTS] = { 0 };			// 每个尺寸类的每 CPU 容量
+	std::atomic<size_t> _misses[NFREELISTS] = {};	// 每个尺寸类 Refill/Drain 的次数
+	std::mutex _initMtx;
+
+	CpuCache() {}
+
+	CpuCache(const CpuCache&) = delete;
+	friend CpuCache* LeakySingleton<CpuCache>();
+};
+#endif
@@ -0,0 +1,253 @@
+﻿#include "HeapProfiler.h"
+#include "PageCache.h"
+#include <cmath>
+#include <cstdio>
+
+#ifndef _WIN32
+#include <execinfo.h>
+#endif
+
+std::atomic<bool> HeapProfiler::_hasSamples{ false };
+
+// 本线程正在分析器里：抓栈、符号化、输出报告时可能再申请内存，这些申请不采样，也避免重入死锁
+static thread_local bool tlsInProfiler = false;
+
+static int CaptureStack(void** stack, int maxDepth)
+{
+#ifdef _WIN32
+	return (int)CaptureStackBackTrace(0, (DWORD)maxDepth, stack, nullptr);
+#else
+	return backtrace(stack, maxDepth);
+#endif
+}
+
+void HeapProfiler::SetSampleRate(size_t bytes)
+{
+	if (bytes > 0)
+	{
+		// glibc 的 backtrace 第一次调用时会加载 libgcc 并申请内存，提前做掉，不放到分配路径里
+		void* stack[1];
+		tlsInProfiler = true;
+		CaptureStack(stack, 1);
+		tlsInProfiler = false;
+	}
+
+	_sampleRate.store(bytes, std::memory_order_relaxed);
+}
+
+int64_t HeapProfiler::NextSampleInterval(uint64_t& rng) const
+{
+	size_t rate = SampleRate();
+	if (rate == 0)
+	{
+		return PROFILE_DISABLED_INTERVAL;
+	}
+
+	// xorshift64*，每个线程各自一份状态，不用加锁
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	uint64_t r = rng * 0x2545F4914F6CDD1Dull;
+
+	// u 取 (0, 1]，-ln(u) * rate 服从均值为 rate 的指数分布
+	double u = (double)((r >> 11) + 1) * (1.0 / 9007199254740992.0);
+	double interval = -std::log(u) * (double)rate;
+	if (interval > (double)(INT64_MAX / 2))
+	{
+		interval = (double)(INT64_MAX / 2);
+	}
+
+	return (int64_t)interval + 1;
+}
+
+void* HeapProfiler::AllocateSampled(size_t size, int skipFrames)
+{
+	if (tlsInProfiler)
+	{
+		return nullptr;
+	}
+	tlsInProfiler = true;
+
+	// 先在栈上抓调用栈，不持有任何锁；跳过本函数这一帧和调用方指定的帧
+	const int kMaxSkip = 4;
+	void* stack[PROFILE_MAX_DEPTH + 1 + kMaxSkip];
+	int skip = 1 + (std::min)(skipFrames, kMaxSkip);
+	int depth = CaptureStack(stack, PROFILE_MAX_DEPTH + skip) - skip;
+
+	// 单独一个 span：页表尺寸类为 NO_SIZE_CLASS，ConcurrentFree 会走大对象路径并发现这是采样对象
+	size_t kpage = SizeClass::_RoundUp(size, (size_t)1 << PAGE_SHIFT) >> PAGE_SHIFT;
+	Span* span = nullptr;
+	try
+	{
+		std::lock_guard<std::mutex> lock(PageCache::GetInstance()->_pageMtx);
+		span = PageCache::GetInstance()->NewSpan(kpage);
+		span->objSize = size;
+		span->_isUse = true;
+	}
+	catch (...)
+	{
+		// 向系统要不到内存，交给调用方处理
+		tlsInProfiler = false;
+		throw;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		StackSample* sample = _samplePool.New();
+		sample->_depth = depth > 0 ? depth : 0;
+		for (int i = 0; i < sample->_depth; ++i)
+		{
+			sample->_stack[i] = stack[i + skip];
+		}
+		sample->_size = size;
+		sample->_interval = SampleRate();
+
+		sample->_next = _samples;
+		if (_samples != nullptr)
+		{
+			_samples->_prev = sample;
+		}
+		_samples = sample;
+		++_liveSamples;
+
+		span->_sample = sample;
+	}
+	_hasSamples.store(true, std::memory_order_relaxed);
+
+	tlsInProfiler = false;
+	return (void*)(span->_pageId << PAGE_SHIFT);
+}
+
+void HeapProfiler::RemoveSample(Span* span)
+{
+	StackSample* sample = span->_sample;
+	assert(sample != nullptr);
+	// span 元数据之后会被合并复用，不能留着旧指针
+	span->_sample = nullptr;
+
+	std::lock_guard<std::mutex> lock(_mtx);
+	if (sample->_prev != nullptr)
+	{
+		sample->_prev->_next = sample->_next;
+	}
+	else
+	{
+		_samples = sample->_next;
+	}
+	if (sample->_next != nullptr)
+	{
+		sample->_next->_prev = sample->_prev;
+	}
+	--_liveSamples;
+
+	_samplePool.Delete(sample);
+}
+
+size_t HeapProfiler::LiveSamples()
+{
+	std::lock_guard<std::mutex> lock(_mtx);
+	return _liveSamples;
+}
+
+// 一个调用栈的汇总
+struct ProfileEntry
+{
+	StackSample _sample;				// 调用栈（取第一个采样的）
+	double _bytes = 0;					// 估算的实际字节数
+	double _count = 0;					// 估算的实际对象数
+	size_t _samples = 0;				// 采中的个数
+};
+
+static bool StackLess(const StackSample& a, const StackSample& b)
+{
+	if (a._depth != b._depth)
+	{
+		return a._depth < b._depth;
+	}
+
+	return std::lexicographical_compare(a._stack, a._stack + a._depth, b._stack, b._stack + b._depth);
+}
+
+static bool StackEqual(const StackSample& a, const StackSample& b)
+{
+	return a._depth == b._depth && std::equal(a._stack, a._stack + a._depth, b._stack);
+}
+
+void HeapProfiler::Dump(std::ostream& os)
+{
+	// 下面的 vector、符号化都会申请内存，不能让它们被采样
+	bool outer = tlsInProfiler;
+	tlsInProfiler = true;
+
+	// 先在锁内把存活采样拷出来，汇总和输出都在锁外做
+	std::vector<StackSample> samples;
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		samples.reserve(_liveSamples);
+		for (StackSample* s = _samples; s != nullptr; s = s->_next)
+		{
+			samples.push_back(*s);
+		}
+	}
+
+	std::sort(samples.begin(), samples.end(), StackLess);
+
+	// 一个大小为 size 的对象被采中的概率是 1 - exp(-size / interval)，按它的倒数还原
+	std::vector<ProfileEntry> entries;
+	double totalBytes = 0;
+	for (const StackSample& s : samples)
+	{
+		double p = 1.0 - std::exp(-(double)s._size / (double)s._interval);
+		double count = p > 0 ? 1.0 / p : 1.0;
+
+		if (entries.empty() || !StackEqual(entries.back()._sample, s))
+		{
+			entries.emplace_back();
+			entries.back()._sample = s;
+		}
+
+		ProfileEntry& e = entries.back();
+		e._bytes += count * (double)s._size;
+		e._count += count;
+		++e._samples;
+		totalBytes += count * (double)s._size;
+	}
+
+	std::sort(entries.begin(), entries.end(), [](const ProfileEntry& a, const ProfileEntry& b) {
+		return a._bytes > b._bytes;
+	});
+
+	char line[256];
+	snprintf(line, sizeof(line), "heap profile: %zu samples, estimated %.0f bytes in use, sample interval %zu bytes\n",
+		samples.size(), totalBytes, SampleRate());
+	os << line;
+
+	for (const ProfileEntry& e : entries)
+	{
+		snprintf(line, sizeof(line), "%12.0f bytes %10.0f objects (%zu samples) @",
+			e._bytes, e._count, e._samples);
+		os << line;
+		for (int i = 0; i < e._sample._depth; ++i)
+		{
+			snprintf(line, sizeof(line), " %p", e._sample._stack[i]);
+			os << line;
+		}
+		os << "\n";
+
+#ifndef _WIN32
+		// 有符号表时顺带输出函数名，方便直接看；没有的话用上面的地址配合 addr2line
+		char** symbols = backtrace_symbols(e._sample._stack, e._sample._depth);
+		if (symbols != nullptr)
+		{
+			for (int i = 0; i < e._sample._depth; ++i)
+			{
+				os << "        " << symbols[i] << "\n";
+			}
+			free(symbols);
+		}
+#endif
+	}
+	os.flush();
+
+	tlsInProfiler = outer;
+}
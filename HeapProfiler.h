@@ -0,0 +1,81 @@
+﻿#pragma once
+#include "Common.h"
+#include "ObjectPool.h"
+#include <ostream>
+
+// 每次采样最多记录的栈帧数
+static const int PROFILE_MAX_DEPTH = 32;
+// 采样关闭时，线程每申请这么多字节回来看一次是否已经打开（打开后最多再过这么多字节生效）
+static const int64_t PROFILE_DISABLED_INTERVAL = 1024 * 1024;
+
+// 一次采样：申请时的调用栈和大小，挂在对象所在的 span 上，对象释放时一起摘掉
+struct StackSample
+{
+	void* _stack[PROFILE_MAX_DEPTH];
+	int _depth = 0;
+	size_t _size = 0;					// 申请的字节数
+	size_t _interval = 0;				// 采样时的平均采样间隔，输出时按它估算实际字节数
+
+	StackSample* _prev = nullptr;		// 存活采样双向链表
+	StackSample* _next = nullptr;
+};
+
+// 采样堆分析器：平均每申请 N 字节（指数分布随机）采一次，记录调用栈
+// 采中的对象单独占一个 span（页表里尺寸类为 NO_SIZE_CLASS），释放时走大对象路径，小对象快路径不用做任何判断
+// 单例模式
+class HeapProfiler
+{
+public:
+	static HeapProfiler* GetInstance()
+	{
+		return LeakySingleton<HeapProfiler>();
+	}
+
+	// 平均采样间隔（字节），0 表示关闭
+	void SetSampleRate(size_t bytes);
+	size_t SampleRate() const
+	{
+		return _sampleRate.load(std::memory_order_relaxed);
+	}
+
+	// 距离下一次采样还要申请多少字节：均值为采样间隔的指数分布，避免和固定的申请模式同步
+	// 关闭时返回 PROFILE_DISABLED_INTERVAL
+	int64_t NextSampleInterval(uint64_t& rng) const;
+
+	// 采样申请：单独切一个 span 并记录调用栈；返回 nullptr 表示这次不采（分析器自身在申请内存），调用方照常分配
+	// skipFrames：调用栈里再跳过几层内存池自己的函数（ThreadCache::Allocate 等）
+	void* AllocateSampled(size_t size, int skipFrames = 0);
+
+	// 采样对象释放前调用：摘掉采样记录，span 由调用方还给 PageCache
+	void RemoveSample(Span* span);
+
+	// 是否可能有存活的采样对象：带大小释放的快路径不查页表，需要靠它判断
+	static bool MayHaveSamples()
+	{
+		return _hasSamples.load(std::memory_order_relaxed);
+	}
+
+	// 存活采样个数
+	size_t LiveSamples();
+
+	// 按调用栈汇总存活采样，估算各调用栈正在使用的内存，从大到小输出
+	void Dump(std::ostream& os);
+
+	// fork 前后调用
+	void LockAll() { _mtx.lock(); }
+	void UnlockAll() { _mtx.unlock(); }
+
+private:
+	std::atomic<size_t> _sampleRate{ 0 };
+	static std::atomic<bool> _hasSamples;
+
+	std::mutex _mtx;					// 保护存活采样链表和对象池
+	StackSample* _samples = nullptr;
+	size_t _liveSamples = 0;
+	ObjectPool<StackSample> _samplePool;
+
+	HeapProfiler() {}
+
+	HeapProfiler(const HeapProfiler&) = delete;
+	friend HeapProfiler* LeakySingleton<HeapProfiler>();
+};
@@ -0,0 +1,432 @@
+﻿// 用内存池替换 malloc/free/new/delete（Linux + glibc）
+// 编译成动态库后用 LD_PRELOAD 注入，或者和程序一起链接，已有代码不用改任何调用点
+// 本库加载前就由 glibc 分配的内存（动态链接器、preload 之前的构造函数等）照样能释放：页表里查不到的指针交回 glibc
+#include "ConcurrentAlloc.h"
+
+#if defined(__linux__) && defined(__GLIBC__)
+#include <dlfcn.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+// glibc 导出的原始实现，处理不属于内存池的指针
+extern "C" void __libc_free(void* ptr);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+
+// malloc 返回的地址要满足任何基本类型的对齐（x86_64 上是 16）
+static const size_t MALLOC_ALIGNMENT = alignof(std::max_align_t);
+// MallocSize 把超过 8 字节的申请取整到 16 的倍数，这些申请能落到的尺寸类都必须是 16 的倍数，对象才满足对齐
+// 默认尺寸类满足；SizeClassGen 不加 --malloc 生成的表可能有 56 这样的尺寸类，malloc(48) 就只有 8 字节对齐
+static constexpr bool SizeClassesKeepMallocAlignment()
+{
+	size_t prev = 0;
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		// (prev, size] 里有 16 的倍数，就会有取整后的申请落到这个尺寸类
+		size_t size = kSizeClasses._sizes[i];
+		if (size > 8 && size % MALLOC_ALIGNMENT != 0 && (size & ~(MALLOC_ALIGNMENT - 1)) > prev)
+		{
+			return false;
+		}
+		prev = size;
+	}
+	return true;
+}
+static_assert(SizeClassesKeepMallocAlignment(), "size classes reachable from malloc must be multiples of 16: generate the table with SizeClassGen --malloc");
+
+// 单次申请的上限：再大页数计算就会溢出，不可能成功，直接失败
+static const size_t MAX_ALLOC_BYTES = SIZE_MAX / 2;
+
+// 尺寸类到 128 字节之前按 8 对齐，24、40 这样的对象只有 8 字节对齐
+// 不超过 8 字节的放不下需要 16 对齐的类型，其余向上取整到 16 的倍数，对象在 span 里的偏移就都是 16 的倍数
+static inline size_t MallocSize(size_t size)
+{
+	if (size <= 8)
+	{
+		return size == 0 ? 1 : size;
+	}
+	if (size > MAX_ALLOC_BYTES)
+	{
+		// 取整会溢出，原样交给 AllocOrNull 拒绝
+		return size;
+	}
+
+	return (size + MALLOC_ALIGNMENT - 1) & ~(MALLOC_ALIGNMENT - 1);
+}
+
+// 申请失败（向系统要不到内存）返回 nullptr 并设置 errno，C 接口不能抛异常
+static inline void* AllocOrNull(size_t size)
+{
+	if (size > MAX_ALLOC_BYTES)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+
+	try
+	{
+		return ConcurrentAlloc(size);
+	}
+	catch (const std::bad_alloc&)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+}
+
+// 按 align 对齐申请（2 的幂）
+static void* AlignedAllocOrNull(size_t align, size_t size)
+{
+	if (align <= MALLOC_ALIGNMENT)
+	{
+		return AllocOrNull(MallocSize(size));
+	}
+
+	if (size > MAX_ALLOC_BYTES || align > MAX_ALLOC_BYTES)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+
+	try
+	{
+		return ConcurrentAllocAligned(size, align);
+	}
+	catch (const std::bad_alloc&)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+}
+
+// 内存池里这块内存实际能用的字节数
+static size_t UsableSize(void* ptr)
+{
+	size_t sizeClass = PageCache::GetInstance()->MapObjectToSizeClass(ptr);
+	if (sizeClass != NO_SIZE_CLASS)
+	{
+		return SizeClass::ClassSize(sizeClass - 1);
+	}
+
+	// 大对象、采样对象、超过一页对齐的对象：从 ptr 到 span 末尾都能用
+	Span* span = PageCache::GetInstance()->MapObjectToSpan(ptr);
+	return ((span->_pageId + span->_n) << PAGE_SHIFT) - (uintptr_t)ptr;
+}
+
+static inline void FreeImpl(void* ptr)
+{
+	if (ptr == nullptr)
+	{
+		return;
+	}
+
+	// 小对象和 ConcurrentFree 一样只查一次页表旁路字节；外来指针所在页没有映射，尺寸类也是 NO_SIZE_CLASS
+	size_t sizeClass = PageCache::GetInstance()->MapObjectToSizeClass(ptr);
+	if (sizeClass != NO_SIZE_CLASS)
+	{
+		ConcurrentFreeSmall(ptr, SizeClass::ClassSize(sizeClass - 1));
+	}
+	else if (PageCache::GetInstance()->Owns(ptr))
+	{
+		ConcurrentFreeLarge(ptr);
+	}
+	else
+	{
+		__libc_free(ptr);
+	}
+}
+
+static inline bool IsPowerOfTwo(size_t n)
+{
+	return n != 0 && (n & (n - 1)) == 0;
+}
+
+extern "C"
+{
+
+void* malloc(size_t size)
+{
+	return AllocOrNull(MallocSize(size));
+}
+
+void free(void* ptr)
+{
+	FreeImpl(ptr);
+}
+
+void cfree(void* ptr)
+{
+	FreeImpl(ptr);
+}
+
+void* calloc(size_t n, size_t size)
+{
+	size_t bytes;
+	if (__builtin_mul_overflow(n, size, &bytes))
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+
+	// 复用的对象里是旧数据，新向系统要的页虽然是零，这里也不区分，统一清零
+	void* ptr = AllocOrNull(MallocSize(bytes));
+	if (ptr != nullptr)
+	{
+		memset(ptr, 0, bytes);
+	}
+	return ptr;
+}
+
+void* realloc(void* ptr, size_t size)
+{
+	if (ptr == nullptr)
+	{
+		return malloc(size);
+	}
+
+	if (!PageCache::GetInstance()->Owns(ptr))
+	{
+		return __libc_realloc(ptr, size);
+	}
+
+	if (size == 0)
+	{
+		FreeImpl(ptr);
+		return nullptr;
+	}
+	if (size > MAX_ALLOC_BYTES)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+
+	try
+	{
+		return ConcurrentRealloc(ptr, MallocSize(size));
+	}
+	catch (const std::bad_alloc&)
+	{
+		// 新对象没申请到，原对象保持不变
+		errno = ENOMEM;
+		return nullptr;
+	}
+}
+
+void* memalign(size_t align, size_t size)
+{
+	if (!IsPowerOfTwo(align))
+	{
+		errno = EINVAL;
+		return nullptr;
+	}
+
+	return AlignedAllocOrNull(align, size);
+}
+
+void* aligned_alloc(size_t align, size_t size)
+{
+	return memalign(align, size);
+}
+
+int posix_memalign(void** memptr, size_t align, size_t size)
+{
+	if (!IsPowerOfTwo(align) || align % sizeof(void*) != 0)
+	{
+		return EINVAL;
+	}
+
+	void* ptr = AlignedAllocOrNull(align, size);
+	if (ptr == nullptr)
+	{
+		return ENOMEM;
+	}
+
+	*memptr = ptr;
+	return 0;
+}
+
+void* valloc(size_t size)
+{
+	return AlignedAllocOrNull((size_t)1 << PAGE_SHIFT, size);
+}
+
+void* pvalloc(size_t size)
+{
+	size_t pageSize = (size_t)1 << PAGE_SHIFT;
+	return AlignedAllocOrNull(pageSize, (size + pageSize - 1) & ~(pageSize - 1));
+}
+
+size_t malloc_usable_size(void* ptr)
+{
+	if (ptr == nullptr)
+	{
+		return 0;
+	}
+
+	if (!PageCache::GetInstance()->Owns(ptr))
+	{
+		// glibc 没有导出 __libc_malloc_usable_size，按名字找下一个实现
+		typedef size_t (*UsableSizeFunc)(void*);
+		static UsableSizeFunc next = (UsableSizeFunc)dlsym(RTLD_NEXT, "malloc_usable_size");
+		return next != nullptr ? next(ptr) : 0;
+	}
+
+	return UsableSize(ptr);
+}
+
+} // extern "C"
+
+// operator new 失败时按标准先调 new_handler，没有 handler 才抛 bad_alloc
+static void* NewImpl(size_t size, size_t align)
+{
+	while (true)
+	{
+		void* ptr = AlignedAllocOrNull(align, size);
+		if (ptr != nullptr)
+		{
+			return ptr;
+		}
+
+		std::new_handler handler = std::get_new_handler();
+		if (handler == nullptr)
+		{
+			throw std::bad_alloc();
+		}
+		handler();
+	}
+}
+
+static void* NewNothrowImpl(size_t size, size_t align) noexcept
+{
+	try
+	{
+		return NewImpl(size, align);
+	}
+	catch (...)
+	{
+		return nullptr;
+	}
+}
+
+// 带大小的 delete：size 是 new 时的大小，按 malloc 的取整规则换算回尺寸类，省掉一次页表查询
+// 本库加载前由 glibc 分配的对象也可能走到这里，和 FreeImpl 一样先确认指针属于内存池
+static inline void SizedDeleteImpl(void* ptr, size_t size)
+{
+	if (ptr == nullptr)
+	{
+		return;
+	}
+
+	if (!PageCache::GetInstance()->Owns(ptr))
+	{
+		__libc_free(ptr);
+		return;
+	}
+
+	ConcurrentFreeSized(ptr, MallocSize(size));
+}
+
+void* operator new(size_t size) { return NewImpl(size, MALLOC_ALIGNMENT); }
+void* operator new[](size_t size) { return NewImpl(size, MALLOC_ALIGNMENT); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return NewNothrowImpl(size, MALLOC_ALIGNMENT); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return NewNothrowImpl(size, MALLOC_ALIGNMENT); }
+
+void operator delete(void* ptr) noexcept { FreeImpl(ptr); }
+void operator delete[](void* ptr) noexcept { FreeImpl(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { FreeImpl(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { FreeImpl(ptr); }
+void operator delete(void* ptr, size_t size) noexcept { SizedDeleteImpl(ptr, size); }
+void operator delete[](void* ptr, size_t size) noexcept { SizedDeleteImpl(ptr, size); }
+
+// C++17 对齐版本：对齐申请用的尺寸类和 size 对不上，释放一律查页表
+void* operator new(size_t size, std::align_val_t align) { return NewImpl(size, (size_t)align); }
+void* operator new[](size_t size, std::align_val_t align) { return NewImpl(size, (size_t)align); }
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept { return NewNothrowImpl(size, (size_t)align); }
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept { return NewNothrowImpl(size, (size_t)align); }
+
+void operator delete(void* ptr, std::align_val_t) noexcept { FreeImpl(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { FreeImpl(ptr); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { FreeImpl(ptr); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { FreeImpl(ptr); }
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept { FreeImpl(ptr); }
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { FreeImpl(ptr); }
+
+// fork 时其他线程可能正持有内存池的锁，子进程里只剩 fork 的线程，这些锁再也不会被释放
+// fork 前按加锁顺序（轨迹记录器 -> 分析器 -> ThreadCache 链表 -> 每 CPU 缓存初始化 -> 中转缓存 -> 中心缓存 -> 页缓存）全部拿到，fork 后父子进程各自释放
+static void ForkPrepare()
+{
+#ifdef ALLOC_TRACE_ENABLED
+	AllocTrace::GetInstance()->LockAll();
+#endif
+	HeapProfiler::GetInstance()->LockAll();
+	ThreadCache::LockAll();
+#ifdef PERCPU_CACHE_ENABLED
+	CpuCache::GetInstance()->LockAll();
+#endif
+	TransferCache::GetInstance()->LockAll();
+	CentralCache::GetInstance()->LockAll();
+	PageCache::GetInstance()->_pageMtx.lock();
+}
+
+static void ForkRelease()
+{
+	PageCache::GetInstance()->_pageMtx.unlock();
+	CentralCache::GetInstance()->UnlockAll();
+	TransferCache::GetInstance()->UnlockAll();
+#ifdef PERCPU_CACHE_ENABLED
+	CpuCache::GetInstance()->UnlockAll();
+#endif
+	ThreadCache::UnlockAll();
+	HeapProfiler::GetInstance()->UnlockAll();
+#ifdef ALLOC_TRACE_ENABLED
+	AllocTrace::GetInstance()->UnlockAll();
+#endif
+}
+
+#ifdef ALLOC_TRACE_ENABLED
+// 子进程不接着往父进程的轨迹里写
+static void ForkChild()
+{
+	ForkRelease();
+	AllocTrace::GetInstance()->StopInChild();
+}
+
+static void StopTraceAtExit()
+{
+	ConcurrentStopTrace();
+}
+
+// 设置环境变量 CM_ALLOC_TRACE=文件名 时，从库加载起记录整个进程的申请释放，退出时写完
+// 子进程会继承环境变量，文件名后面加上进程号，各写各的
+__attribute__((constructor)) static void StartTraceFromEnv()
+{
+	const char* path = getenv("CM_ALLOC_TRACE");
+	if (path == nullptr || path[0] == '\0')
+	{
+		return;
+	}
+
+	char file[4096];
+	snprintf(file, sizeof(file), "%s.%d", path, (int)getpid());
+	if (ConcurrentStartTrace(file))
+	{
+		atexit(StopTraceAtExit);
+	}
+}
+#else
+static void ForkChild()
+{
+	ForkRelease();
+}
+#endif
+
+__attribute__((constructor)) static void RegisterForkHandlers()
+{
+	pthread_atfork(ForkPrepare, ForkRelease, ForkChild);
+}
+#endif
@@ -1,6 +1,6 @@
 ﻿#include "PageCache.h"
-
-PageCache PageCache::_sInst;
+#include "AllocatorStats.h"
+#include <chrono>
 
 void PageCache::MapSpan(Span* span)
 {
@@ -8,16 +8,145 @@ void PageCache::MapSpan(Span* span)
     for (PAGE_ID i = 0; i < span->_n; i++)
     {
         _idSpanMap.set(span->_pageId + i, span);
+        // 新建/合并后的 span 还没切小对象，旁路尺寸类先清零
+        _idSpanMap.set_sizeclass(span->_pageId + i, (uint8_t)NO_SIZE_CLASS);
     }
 }
 
-void PageCache::UnmapSpan(Span* span)
+void PageCache::SetSpanSizeClass(Span* span, size_t sizeClass)
 {
-    // 释放大块内存前清理映射，避免悬挂指针
+    assert(sizeClass <= NFREELISTS);
+
     for (PAGE_ID i = 0; i < span->_n; i++)
     {
-        _idSpanMap.set(span->_pageId + i, nullptr);
+        _idSpanMap.set_sizeclass(span->_pageId + i, (uint8_t)sizeClass);
+    }
+}
+
+// 空闲 span 只需要首尾两页的映射：合并时只会通过相邻页号（前一个 span 的尾页、后一个 span 的首页）找到它
+// 大 span 合并后可能有成千上万页，不用每次都把所有页重写一遍
+void PageCache::MapFreeSpan(Span* span)
+{
+    _idSpanMap.set(span->_pageId, span);
+    _idSpanMap.set(span->_pageId + span->_n - 1, span);
+}
+
+void PageCache::PushFreeSpan(Span* span)
+{
+    FreeSpanSet& set = FreeSetOf(span);
+    if (span->_n < NPAGES)
+    {
+        set._spanLists[span->_n].PushFront(span);
+        set._nonEmptyBuckets.Set(span->_n);
+    }
+    else
+    {
+        set._largeSpans.Insert(span);
+    }
+    set._pages += span->_n;
+    ++set._spans;
+}
+
+void PageCache::EraseFreeSpan(Span* span)
+{
+    FreeSpanSet& set = FreeSetOf(span);
+    if (span->_n < NPAGES)
+    {
+        set._spanLists[span->_n].Erase(span);
+        if (set._spanLists[span->_n].Empty())
+        {
+            set._nonEmptyBuckets.Clear(span->_n);
+        }
+    }
+    else
+    {
+        set._largeSpans.Erase(span);
+    }
+    set._pages -= span->_n;
+    --set._spans;
+}
+
+Span* PageCache::FindFreeSpan(FreeSpanSet& set, size_t k)
+{
+    // 小于 128 页：用位图找 >= k 的第一个非空桶
+    if (k < NPAGES)
+    {
+        size_t i = set._nonEmptyBuckets.FindFirstSet(k);
+        if (i < NPAGES)
+        {
+            return set._spanLists[i].Begin();
+        }
     }
+
+    // 页桶里没有合适的，或者要的本来就是大块：在空闲大 span 里找最佳适配
+    return set._largeSpans.BestFit(k);
+}
+
+// span 已从空闲结构摘下：把 [start, start + n) 以外的头尾切出来挂回（状态不变），返回中间这段
+Span* PageCache::SplitFreeSpan(Span* span, PAGE_ID start, size_t n)
+{
+    PAGE_ID end = start + n;
+    PAGE_ID spanEnd = span->_pageId + span->_n;
+    assert(start >= span->_pageId && end <= spanEnd);
+
+    if (start > span->_pageId)
+    {
+        Span* head = _spanPool.New();
+        head->_pageId = span->_pageId;
+        head->_n = start - span->_pageId;
+        head->_isCommitted = span->_isCommitted;
+
+        PushFreeSpan(head);
+        MapFreeSpan(head);
+    }
+
+    if (end < spanEnd)
+    {
+        Span* tail = _spanPool.New();
+        tail->_pageId = end;
+        tail->_n = spanEnd - end;
+        tail->_isCommitted = span->_isCommitted;
+
+        PushFreeSpan(tail);
+        MapFreeSpan(tail);
+    }
+
+    span->_pageId = start;
+    span->_n = n;
+    return span;
+}
+
+// 从空闲 span 切 k 页出来用，剩下的挂回空闲结构
+Span* PageCache::CarveSpan(Span* span, size_t k)
+{
+    assert(span->_n >= k);
+    // 先摘下来再改页数，页数是桶号/树的键
+    EraseFreeSpan(span);
+
+    // 默认从头部切
+    PAGE_ID start = span->_pageId;
+#ifdef USE_HUGEPAGE_HEAP
+    // 头部从大页边界开始（这个大页整页空闲）而尾部落在一个用了一部分的大页里：从尾部切
+    // 小 span 尽量塞进已经在用的大页，完整的空闲大页留给大对象或者整页归还
+    PAGE_ID spanEnd = span->_pageId + span->_n;
+    if (span->_pageId % HUGEPAGE_PAGES == 0 && spanEnd % HUGEPAGE_PAGES != 0)
+    {
+        start = spanEnd - k;
+    }
+#endif
+    span = SplitFreeSpan(span, start, k);
+
+    // 从已归还的 span 上切下来的，交出去之前重新提交
+    if (!span->_isCommitted)
+    {
+        SystemCommit((void*)(span->_pageId << PAGE_SHIFT), span->_n);
+        span->_isCommitted = true;
+    }
+
+    // 建立 id 和 span 的映射，方便 central cache 回收小块内存时，查找对应的 span
+    MapSpan(span);
+
+    return span;
 }
 
 // 获取一个 k 页的 Span
@@ -26,10 +155,41 @@ Span* PageCache::NewSpan(size_t k)
 {
 	assert(k > 0);
 
-	// 大于 128 页的直接向堆申请
+	// 正好 k 页直接用，更大的切分
+	// 先找物理页还在的；没有再用已归还的，重新提交即可，仍然比向系统要新地址空间好
+	// 大块内存释放后也留在这里，再申请时直接复用已映射的内存，不用再走 mmap
+	Span* fit = FindFreeSpan(_committed, k);
+	if (fit == nullptr)
+	{
+		fit = FindFreeSpan(_released, k);
+	}
+	if (fit != nullptr)
+	{
+		return CarveSpan(fit, k);
+	}
+
+#ifdef USE_HUGEPAGE_HEAP
+	// 按整 2MB 大页向系统要，起始地址按大页对齐，挂进空闲结构后再切
+	// 小 span 一次只要一个大页；大对象向上取整到大页，末尾剩下的零头留给小 span 用
+	size_t growPages = SizeClass::_RoundUp(k, HUGEPAGE_PAGES);
+	Span* hugeSpan = _spanPool.New();
+	void* ptr = SystemAllocHugepages(growPages);
+	_systemBytes += growPages << PAGE_SHIFT;
+	++_systemAllocs;
+	hugeSpan->_pageId = (PAGE_ID)ptr >> PAGE_SHIFT;
+	hugeSpan->_n = growPages;
+
+	// 和前面紧挨着的空闲大页合并，大对象可以跨大页切
+	CoalesceAndPush(hugeSpan);
+
+	return NewSpan(k);
+#else
+	// 大于 128 页的直接向系统申请正好 k 页
 	if (k > NPAGES - 1)
 	{
 		void* ptr = SystemAlloc(k);
+		_systemBytes += k << PAGE_SHIFT;
+		++_systemAllocs;
 		//Span* span = new Span;
 		Span* span = _spanPool.New();
 		span->_pageId = (PAGE_ID)ptr >> PAGE_SHIFT;
@@ -41,104 +201,149 @@ Span* PageCache::NewSpan(size_t k)
 		return span;
 	}
 
-	// 先检查第 k 个桶里面有没有 span
-	if (!_spanLists[k].Empty())
-	{
-		 Span* kSpan = _spanLists[k].PopFront();
+	// 走到这个位置就说明后面没有更大的 span 了
+	// 这时就要去堆要一个 128 页的 span
+	//Span* bigSpan = new Span;
+	Span* bigSpan = _spanPool.New();
+	void* ptr = SystemAlloc(NPAGES - 1);
+	_systemBytes += (NPAGES - 1) << PAGE_SHIFT;
+	++_systemAllocs;
+	bigSpan->_pageId = (PAGE_ID)ptr >> PAGE_SHIFT;
+	bigSpan->_n = NPAGES - 1;
 
-		// 建立 id 和 span 的映射，方便 central cache 回收小块内存时，查找对应的 span
-		MapSpan(kSpan);
+	// 维护 page -> span 映射，保证合并查找正确
+	PushFreeSpan(bigSpan);
+	MapFreeSpan(bigSpan);
 
-		return kSpan;
-	}
+	return NewSpan(k);
+#endif
+}
 
-	// 检查一下后面的桶里面有没有 span ，如果有可以把它进行切分
-	for (size_t i = k + 1; i < NPAGES; i++)
-	{
-		if (!_spanLists[i].Empty())
-		{
-			Span* nSpan =_spanLists[i].PopFront();
-			//Span* kSpan = new Span;
-			Span* kSpan = _spanPool.New();
+// 先多要 alignPages - 1 页，保证里面一定有对齐的 k 页；头尾多出来的马上还回去，不会一直占着
+Span* PageCache::NewAlignedSpan(size_t k, size_t alignPages)
+{
+	assert(alignPages > 0 && (alignPages & (alignPages - 1)) == 0);
 
-			// 再 nSpan 的头部切一个 k 页下来
-			// k 页 span 返回
-			// nSpan 再挂到对应的映射位置
-			kSpan->_pageId = nSpan->_pageId;
-			kSpan->_n = k;
+	Span* span = NewSpan(k + alignPages - 1);
+	PAGE_ID spanStart = span->_pageId;
+	PAGE_ID spanEnd = span->_pageId + span->_n;
+	PAGE_ID start = SizeClass::_RoundUp(spanStart, alignPages);
+	PAGE_ID end = start + k;
 
-			nSpan->_pageId += k;
-			nSpan->_n -= k;
+	// 先改小 span 并标记在用再还头尾：合并时看到的相邻 span 就是它，不会被合并进去
+	span->_pageId = start;
+	span->_n = k;
+	span->_isUse = true;
 
-			_spanLists[nSpan->_n].PushFront(nSpan);
-			// free span 也维护完整页映射，便于合并与定位
-			MapSpan(nSpan);
+	if (start > spanStart)
+	{
+		Span* head = _spanPool.New();
+		head->_pageId = spanStart;
+		head->_n = start - spanStart;
+		CoalesceAndPush(head);
+	}
 
-			// 建立 id 和 span 的映射，方便 central cache 回收小块内存时，查找对应的 span
-			MapSpan(kSpan);
+	if (end < spanEnd)
+	{
+		Span* tail = _spanPool.New();
+		tail->_pageId = end;
+		tail->_n = spanEnd - end;
+		CoalesceAndPush(tail);
+	}
+
+	return span;
+}
+bool PageCache::ResizeSpan(Span* span, size_t k)
+{
+	assert(span->_isUse && k > 0);
 
-			return kSpan;
+	PAGE_ID spanEnd = span->_pageId + span->_n;
+	if (k <= span->_n)
+	{
+		if (k < span->_n)
+		{
+			Span* tail = _spanPool.New();
+			tail->_pageId = span->_pageId + k;
+			tail->_n = span->_n - k;
+			span->_n = k;
+			CoalesceAndPush(tail);
 		}
+		return true;
 	}
 
-	// 走到这个位置就说明后面没有更大的 span 了
-	// 这时就要去堆要一个 128 页的 span
-	//Span* bigSpan = new Span;
-	Span* bigSpan = _spanPool.New();
-	void* ptr = SystemAlloc(NPAGES - 1);
-	bigSpan->_pageId = (PAGE_ID)ptr >> PAGE_SHIFT;
-	bigSpan->_n = NPAGES - 1;
+	// 后面紧挨着的必须是空闲 span（空闲 span 的首页有映射），而且页数够
+	size_t extra = k - span->_n;
+	Span* next = (Span*)_idSpanMap.get(spanEnd);
+	if (next == nullptr || next->_isUse || next->_pageId != spanEnd || next->_n < extra)
+	{
+		return false;
+	}
 
-	// 维护 page -> span 映射，保证合并查找正确
-	MapSpan(bigSpan);
+	EraseFreeSpan(next);
+	next = SplitFreeSpan(next, spanEnd, extra);
+	if (!next->_isCommitted)
+	{
+		SystemCommit((void*)(next->_pageId << PAGE_SHIFT), next->_n);
+	}
 
-	_spanLists[bigSpan->_n].PushFront(bigSpan);
-	return NewSpan(k);
-}
+	// 新接上的页映射到原 span，释放时按任意页都能找回
+	for (PAGE_ID i = spanEnd; i < spanEnd + extra; ++i)
+	{
+		_idSpanMap.set(i, span);
+		_idSpanMap.set_sizeclass(i, (uint8_t)NO_SIZE_CLASS);
+	}
+	span->_n = k;
+	_spanPool.Delete(next);
 
+	return true;
+}
 
 // 通过页号快速定位 span，回收时必须 O(1)
 Span* PageCache::MapObjectToSpan(void* obj)
 {
 	PAGE_ID id = ((PAGE_ID)obj >> PAGE_SHIFT);
 
-	// 保护页表读写，避免并发更新导致数据竞争
-	std::lock_guard<std::mutex> lock(_pageMtx);
-
+	// 不加 _pageMtx：页表支持无锁并发读
+	// 调用方持有 obj 时，obj 所在 span 不会被合并或释放，读到的映射一定稳定
 	auto ret = (Span*)_idSpanMap.get(id);
 	assert(ret != nullptr);
 	return ret;
 }
 
-void PageCache::ReleaseSpanToPageCache(Span* span)
+// 和 MapObjectToSpan 一样无锁，只读页表里的一个字节，不碰 Span 元数据
+size_t PageCache::MapObjectToSizeClass(void* obj)
 {
-	// 大于 128 页的直接还给堆
-	if (span->_n > NPAGES - 1)
-	{
-		// 释放前清理映射，避免悬挂指针
-		UnmapSpan(span);
+	PAGE_ID id = ((PAGE_ID)obj >> PAGE_SHIFT);
 
-		void* ptr = (void*)(span->_pageId << PAGE_SHIFT);
-		SystemFree(ptr);
-		//delete span;
-		_spanPool.Delete(span);
-	
-		return;
-	}
+	return _idSpanMap.sizeclass(id);
+}
+
+bool PageCache::Owns(void* obj)
+{
+	PAGE_ID id = ((PAGE_ID)obj >> PAGE_SHIFT);
+
+	// 内存池的页在用时一定有映射；没有映射的页不是本池分出去的
+	return _idSpanMap.get(id) != nullptr;
+}
 
+void PageCache::ReleaseSpanToPageCache(Span* span)
+{
+	// 用过的 span 物理页一定在
+	span->_isUse = false;
+	span->_isCommitted = true;
+	CoalesceAndPush(span);
+}
+
+void PageCache::CoalesceAndPush(Span* span)
+{
 	// 对 span 前后的页尝试进行合并，缓解内存碎片问题
+	// 大 span 也参与合并，合并结果没有 128 页上限：超过的放进大 span 树
+	// 只合并提交状态相同的：否则合并后要么多提交一段，要么把刚还回来的热内存也还给系统
 	while (1)
 	{
 		PAGE_ID prevId = span->_pageId - 1;
-		//auto ret = _idSpanMap.find(prevId);
-
-		//// 前面的页号没有，不合并了
-		//if (ret == _idSpanMap.end())
-		//{
-		//	break;
-		//}
-
 
+		// 前面的页号没有，不合并了
 		auto ret = (Span*)_idSpanMap.get(prevId);
 		if (ret == nullptr)
 		{
@@ -147,21 +352,16 @@ void PageCache::ReleaseSpanToPageCache(Span* span)
 
 		// 前面相邻页的 span 还在使用，不合并了
 		Span* prevSpan = ret;
-		if (prevSpan->_isUse == true)
+		if (prevSpan->_isUse == true || prevSpan->_isCommitted != span->_isCommitted)
 		{
 			break;
 		}
 
-		// 合并出超出 128 页的 span 没办法管理，不合并了
-		if (prevSpan->_n + span->_n > NPAGES - 1)
-		{
-			break;
-		}
+		EraseFreeSpan(prevSpan);
 
 		span->_pageId = prevSpan->_pageId;
 		span->_n += prevSpan->_n;
 
-		_spanLists[prevSpan->_n].Erase(prevSpan);
 		//delete prevSpan;
 		_spanPool.Delete(prevSpan);
 	}
@@ -170,43 +370,189 @@ void PageCache::ReleaseSpanToPageCache(Span* span)
 	while (1)
 	{
 		PAGE_ID nextId = span->_pageId + span->_n;
-		//auto ret = _idSpanMap.find(nextId);
-
-		//// 后面的页号没有，不合并了
-		//if (ret == _idSpanMap.end())
-		//{
-		//	break;
-		//}
 
+		// 后面的页号没有，不合并了
 		auto ret = (Span*)_idSpanMap.get(nextId);
 		if (ret == nullptr)
 		{
 			break;
 		}
 
-
 		Span* nextSpan = ret;
-		if (nextSpan->_isUse == true)
+		if (nextSpan->_isUse == true || nextSpan->_isCommitted != span->_isCommitted)
 		{
 			break;
 		}
 
-		// 合并出超出 128 页的 span 没办法管理，不合并了
-		if (nextSpan->_n + span->_n > NPAGES - 1)
-		{
-			break;
-		}
+		EraseFreeSpan(nextSpan);
 
 		span->_n += nextSpan->_n;
 
-		_spanLists[nextSpan->_n].Erase(nextSpan);
 		//delete nextSpan;
 		_spanPool.Delete(nextSpan);
 	}
 
-	_spanLists[span->_n].PushFront(span);
-	span->_isUse = false;
+	PushFreeSpan(span);
+
+	// 合并后更新首尾页到 span 的映射
+	MapFreeSpan(span);
+}
+
+Span* PageCache::PickSpanToRelease()
+{
+	if (!_committed._largeSpans.Empty())
+	{
+		return _committed._largeSpans.Largest();
+	}
+
+	for (size_t i = NPAGES - 1; i > 0; --i)
+	{
+		if (_committed._nonEmptyBuckets.Test(i))
+		{
+			return _committed._spanLists[i].Begin();
+		}
+	}
+
+	return nullptr;
+}
 
-	// 合并后更新所有页到 span 的映射
-	MapSpan(span);
-}
\ No newline at end of file
+#ifdef USE_HUGEPAGE_HEAP
+// span 里按大页对齐的内部区间 [start, start + n)，不含完整大页返回 false
+static bool HugepageRange(const Span* span, PAGE_ID& start, size_t& n)
+{
+	PAGE_ID first = SizeClass::_RoundUp(span->_pageId, HUGEPAGE_PAGES);
+	PAGE_ID last = (span->_pageId + span->_n) & ~(PAGE_ID)(HUGEPAGE_PAGES - 1);
+	start = first;
+	n = last > first ? last - first : 0;
+	return n > 0;
+}
+
+// 只有 >= HUGEPAGE_PAGES 页的 span 才可能包含整个大页，它们都在大 span 树里
+// 树按页数从小到大遍历，头插后链表从大到小；不能在持有页锁时申请内存，所以不用 vector
+Span* PageCache::CollectHugepageSpans()
+{
+	Span* head = nullptr;
+	_committed._largeSpans.ForEach([&](Span* span) {
+		PAGE_ID start = 0;
+		size_t n = 0;
+		if (HugepageRange(span, start, n))
+		{
+			span->_next = head;
+			head = span;
+		}
+	});
+
+	return head;
+}
+#endif
+
+size_t PageCache::ReleaseRange(Span* span, PAGE_ID start, size_t n)
+{
+	EraseFreeSpan(span);
+	span = SplitFreeSpan(span, start, n);
+
+	SystemDecommit((void*)(span->_pageId << PAGE_SHIFT), span->_n);
+	span->_isCommitted = false;
+
+	// 和相邻的已归还 span 合并，避免已归还区域碎成很多小段
+	CoalesceAndPush(span);
+
+	return n;
+}
+
+size_t PageCache::ReleaseAtMost(size_t bytes)
+{
+	size_t releasedPages = 0;
+	size_t wantPages = (bytes >> PAGE_SHIFT) + ((bytes & ((1 << PAGE_SHIFT) - 1)) ? 1 : 0);
+
+#ifdef USE_HUGEPAGE_HEAP
+	// 先还整个的大页：只还大页里的一部分会让内核拆掉透明大页，剩下的页也失去大页映射
+	// 额度按整大页向上取整，多还的部分由后台线程从之后的额度里扣
+	// 候选只收集一次：归还一个 span 只会和已归还的邻居合并，不影响其他已提交的候选
+	Span* span = CollectHugepageSpans();
+	while (span != nullptr)
+	{
+		Span* next = span->_next;
+		span->_next = nullptr;
+
+		if (releasedPages < wantPages)
+		{
+			PAGE_ID start = 0;
+			size_t n = 0;
+			HugepageRange(span, start, n);
+			size_t need = SizeClass::_RoundUp(wantPages - releasedPages, HUGEPAGE_PAGES);
+			releasedPages += ReleaseRange(span, start, (std::min)(n, need));
+		}
+
+		// 额度用完后剩下的候选只摘掉链接
+		span = next;
+	}
+#endif
+
+	while (releasedPages < wantPages)
+	{
+		Span* span = PickSpanToRelease();
+		if (span == nullptr)
+		{
+			break;
+		}
+
+		// 比剩下的额度大：只还头部一段，尾部留在已提交的空闲结构里，按速率慢慢还
+		size_t need = wantPages - releasedPages;
+		releasedPages += ReleaseRange(span, span->_pageId, (std::min)(span->_n, need));
+	}
+
+	return releasedPages << PAGE_SHIFT;
+}
+
+// 后台线程醒来的间隔，每次按速率还一小份，不长时间占着页锁
+static const size_t RELEASE_INTERVAL_MS = 100;
+
+void PageCache::SetReleaseRate(size_t bytesPerSecond)
+{
+	_releaseRate.store(bytesPerSecond, std::memory_order_relaxed);
+
+	if (bytesPerSecond > 0)
+	{
+		std::call_once(_releaseThreadOnce, [this]() {
+			std::thread(&PageCache::BackgroundRelease, this).detach();
+		});
+	}
+}
+
+void PageCache::BackgroundRelease()
+{
+	// 额度按时间累积：一次多还了（整大页取整、速率很低时至少还一页），后面几轮少还，平均速率不变
+	long long credit = 0;
+	while (true)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(RELEASE_INTERVAL_MS));
+
+		size_t rate = _releaseRate.load(std::memory_order_relaxed);
+		if (rate == 0)
+		{
+			credit = 0;
+			continue;
+		}
+
+		credit += (long long)(rate / (1000 / RELEASE_INTERVAL_MS));
+		if (credit <= 0)
+		{
+			continue;
+		}
+
+		std::lock_guard<std::mutex> lock(_pageMtx);
+		size_t released = ReleaseAtMost((size_t)credit);
+		// 没有可还的了就不再攒额度，免得之后一次还太多
+		credit = released > 0 ? credit - (long long)released : 0;
+	}
+}
+
+void PageCache::CollectStats(AllocatorStats& stats) const
+{
+	stats._pageHeapFreeBytes += _committed._pages << PAGE_SHIFT;
+	stats._pageHeapReleasedBytes += _released._pages << PAGE_SHIFT;
+	stats._pageHeapFreeSpans += _committed._spans + _released._spans;
+	stats._systemBytes += _systemBytes;
+	stats._systemAllocs += _systemAllocs;
+}
@@ -2,40 +2,133 @@
 #include "Common.h"
 #include "ObjectPool.h"
 #include "PageMap.h"
+#include "SpanTree.h"
+
+struct AllocatorStats;
 
 class PageCache
 {
 public:
 	static PageCache* GetInstance()
 	{
-		return &_sInst;
+		return LeakySingleton<PageCache>();
 	}
 
 	// 获取从对象到 span 的映射
 	Span* MapObjectToSpan(void* obj);
 
+	// 获取对象所在页的尺寸类（桶号 + 1），大对象返回 NO_SIZE_CLASS，不访问 Span
+	size_t MapObjectToSizeClass(void* obj);
+
+	// obj 是否在内存池管理的页上：替换 malloc 后用来识别其他分配器给的指针，无锁
+	bool Owns(void* obj);
+
+	// 把 span 的所有页标记为某个尺寸类（桶号 + 1），需在 _pageMtx 下调用
+	void SetSpanSizeClass(Span* span, size_t sizeClass);
+
 	// 释放空间 span 回到 PageCache，并合并相邻的 span
 	void ReleaseSpanToPageCache(Span* span);
 
 	// 获取一个 k 页的 Span
 	Span* NewSpan(size_t k);
 
-	// 全局页级锁，保护页表和空闲 span 列表
+	// 获取一个起始页号按 alignPages（2 的幂）对齐的 k 页 Span，对齐点前后多切的页当场挂回空闲结构
+	Span* NewAlignedSpan(size_t k, size_t alignPages);
+
+	// 在用的大对象 span 原地改成 k 页：缩小时尾部挂回空闲结构，变大时吞掉紧挨在后面的空闲页
+	// 后面的空闲页不够返回 false，span 不变
+	bool ResizeSpan(Span* span, size_t k);
+
+	// 非空页桶位图（已提交的空闲 span）：第 i 位为 1 表示第 i 个桶有空闲 span，需在 _pageMtx 下读取
+	// 供选桶策略直接使用，不用逐个桶判断
+	const Bitmap<NPAGES>& NonEmptyBuckets() const
+	{
+		return _committed._nonEmptyBuckets;
+	}
+
+	// 把最多 bytes 字节的空闲页还给系统（大 span 只切出需要的部分），返回实际归还的字节数
+	// 需在 _pageMtx 下调用
+	size_t ReleaseAtMost(size_t bytes);
+
+	// 后台归还速率（字节/秒），0 表示暂停；第一次设成非 0 时启动后台线程
+	void SetReleaseRate(size_t bytesPerSecond);
+
+	// 空闲页统计：仍占物理内存的 / 已还给系统的，需在 _pageMtx 下读取
+	size_t FreeCommittedBytes() const
+	{
+		return _committed._pages << PAGE_SHIFT;
+	}
+	size_t FreeReleasedBytes() const
+	{
+		return _released._pages << PAGE_SHIFT;
+	}
+
+	// 累加页级统计：空闲/已归还的页和 span 个数、向系统申请的总量，需在 _pageMtx 下调用
+	void CollectStats(AllocatorStats& stats) const;
+
+	// 全局页级锁，保护页表写入和空闲 span 列表（页表读取无锁）
 	std::mutex _pageMtx;
 private:
-	// 建立页号到 span 的映射
+	// 一组空闲 span：< NPAGES 页的按页数分桶（带非空位图），更大的放进按 (页数, 地址) 有序的树，最佳适配
+	struct FreeSpanSet
+	{
+		SpanList _spanLists[NPAGES];
+		Bitmap<NPAGES> _nonEmptyBuckets;
+		SpanTree _largeSpans;
+		size_t _pages = 0;			// 总页数
+		size_t _spans = 0;			// span 个数
+	};
+
+	// 空闲 span 按物理页是否还在分两组：分配优先用已提交的，省一次缺页
+	FreeSpanSet& FreeSetOf(Span* span)
+	{
+		return span->_isCommitted ? _committed : _released;
+	}
+
+	// 在一组空闲 span 里找 >= k 页的最佳适配，没有返回 nullptr
+	static Span* FindFreeSpan(FreeSpanSet& set, size_t k);
+
+	// 建立页号到 span 的映射，同时把尺寸类清成 NO_SIZE_CLASS
 	void MapSpan(Span* span);
-	// 清理页号映射，避免悬挂
-	void UnmapSpan(Span* span);
+	// 空闲 span 只映射首尾页，合并时够用
+	void MapFreeSpan(Span* span);
+
+	// 空闲 span 进出它所属的那组空闲结构
+	void PushFreeSpan(Span* span);
+	void EraseFreeSpan(Span* span);
 
-	// 按页数分桶管理空闲 span
-	SpanList _spanLists[NPAGES];
+	// 和前后状态相同的空闲 span 合并，再挂进空闲结构
+	void CoalesceAndPush(Span* span);
+
+	// 已摘下的空闲 span 只留 [start, start + n)，头尾剩余部分挂回
+	Span* SplitFreeSpan(Span* span, PAGE_ID start, size_t n);
+
+	// 从空闲 span 切出 k 页，剩余部分挂回
+	Span* CarveSpan(Span* span, size_t k);
+
+	// 挑一个已提交的空闲 span 去归还，先挑大的，一次系统调用还得多
+	Span* PickSpanToRelease();
+#ifdef USE_HUGEPAGE_HEAP
+	// 一次遍历收集所有包含完整大页的已提交空闲 span，借 _next 串起来（大 span 树不用这个字段），span 从大到小
+	Span* CollectHugepageSpans();
+#endif
+	// 归还空闲 span 里的 [start, start + n)，返回页数
+	size_t ReleaseRange(Span* span, PAGE_ID start, size_t n);
+
+	// 后台归还线程主循环
+	void BackgroundRelease();
+
+	FreeSpanSet _committed;		// 物理页还在的空闲 span
+	FreeSpanSet _released;		// 已经还给系统的空闲 span
+
+	size_t _systemBytes = 0;	// 向系统申请的总字节
+	size_t _systemAllocs = 0;	// 向系统申请的次数
 	// span 元数据对象池，避免频繁 new/delete
 	ObjectPool<Span> _spanPool;
 
 	//std::unordered_map<PAGE_ID, Span*> _idSpanMap;
 	//std::map<void*, Span*> _idSpanMap;
-#ifdef _WIN64
+#if defined(_WIN64) || (defined(__linux__) && defined(__LP64__))
 	// 64 位地址空间需要更大页号映射，避免 PageMap 越界/失效
 	static constexpr int kPageIdBits = 48 - PAGE_SHIFT;
 	TCMalloc_PageMap3<kPageIdBits> _idSpanMap;
@@ -43,8 +136,11 @@ private:
 	TCMalloc_PageMap1<32 - PAGE_SHIFT> _idSpanMap;
 #endif
 
+	std::atomic<size_t> _releaseRate{ 0 };
+	std::once_flag _releaseThreadOnce;
+
 	PageCache() {}
 
 	PageCache(const PageCache&) = delete;
-	static PageCache _sInst;
+	friend PageCache* LeakySingleton<PageCache>();
 };
\ No newline at end of file
@@ -3,6 +3,12 @@
 #include "ObjectPool.h"
 #include <cstdint>
 #include <cstring>
+#include <atomic>
+
+// 并发约定：
+// get/sizeclass 无锁读（wait-free），可以与写并发；set/set_sizeclass/Ensure 只能在 PageCache::_pageMtx 下调用
+// 每页除了 span 指针，还旁路存一个字节的尺寸类，free 时不用访问 Span 就能定位桶
+// 叶子/中间节点和每个表项都用 release 发布、acquire 读取，读者要么看到旧值要么看到完整的新值
 
 // 1. 单层数组实现
 // 适合 32 位地址空间：速度快，但内存占用固定
@@ -12,7 +18,8 @@ class TCMalloc_PageMap1
 private:
     // 固定长度数组，避免运行期扩容
     static const int LENGTH = 1 << BITS;
-    void** array_;
+    std::atomic<void*>* array_;
+    std::atomic<uint8_t>* classes_;     // 与 array_ 一一对应的尺寸类
 
 public:
     typedef uintptr_t Number;
@@ -24,8 +31,12 @@ public:
         //array_ = reinterpret_cast<void**>((*allocator)(sizeof(void*) << BITS));
         size_t size = sizeof(void*) << BITS;
         size_t alignSize = SizeClass::_RoundUp(size, 1 << PAGE_SHIFT);
-        array_ = (void**)SystemAlloc(alignSize >> PAGE_SHIFT);
-        memset(array_, 0, sizeof(void*) << BITS);
+        array_ = (std::atomic<void*>*)SystemAlloc(alignSize >> PAGE_SHIFT);
+        memset((void*)array_, 0, sizeof(void*) << BITS);
+
+        size_t classSize = SizeClass::_RoundUp((size_t)1 << BITS, 1 << PAGE_SHIFT);
+        classes_ = (std::atomic<uint8_t>*)SystemAlloc(classSize >> PAGE_SHIFT);
+        memset((void*)classes_, 0, (size_t)1 << BITS);
     }
 
     // 返回 key 的当前值，如果没设置，或者k超出范围，返回NULL
@@ -37,7 +48,7 @@ public:
             return NULL;
         }
 
-        return array_[k];
+        return array_[k].load(std::memory_order_acquire);
     }
 
     //要求“k”处于“[0, 2 ^ bits - 1]”范围内
@@ -46,7 +57,24 @@ public:
     // set 时按需创建路径，避免一次性占用大内存
     void set(Number k, void* v)
     {
-        array_[k] = v;
+        array_[k].store(v, std::memory_order_release);
+    }
+
+    // 返回 key 的尺寸类，没设置或超出范围返回 0
+    uint8_t sizeclass(Number k) const
+    {
+        if ((k >> BITS) > 0)
+        {
+            return 0;
+        }
+
+        return classes_[k].load(std::memory_order_acquire);
+    }
+
+    // 要求 key 已经验证过
+    void set_sizeclass(Number k, uint8_t cl)
+    {
+        classes_[k].store(cl, std::memory_order_release);
     }
 };
 
@@ -69,10 +97,11 @@ private:
     // 叶节点
     struct Leaf
     {
-        void* values[LEAF_LENGTH];
+        std::atomic<void*> values[LEAF_LENGTH];
+        std::atomic<uint8_t> classes[LEAF_LENGTH];
     };
 
-    Leaf* root_[ROOT_LENGTH];            // 指向32个子节点的指针
+    std::atomic<Leaf*> root_[ROOT_LENGTH];  // 指向32个子节点的指针
     void* (*allocator_)(size_t);         // 内存分配器
 
 public:
@@ -83,7 +112,7 @@ public:
     explicit TCMalloc_PageMap2()
     {
         //allocator_ = allocator;
-        memset(root_, 0, sizeof(root_));
+        memset((void*)root_, 0, sizeof(root_));
 
         PreallocateMoreMemory();
     }
@@ -93,12 +122,18 @@ public:
     {
         const Number i1 = k >> LEAF_BITS;
         const Number i2 = k & (LEAF_LENGTH - 1);
-        if ((k >> BITS) > 0 || root_[i1] == NULL)
+        if ((k >> BITS) > 0)
+        {
+            return NULL;
+        }
+
+        Leaf* leaf = root_[i1].load(std::memory_order_acquire);
+        if (leaf == NULL)
         {
             return NULL;
         }
 
-        return root_[i1]->values[i2];
+        return leaf->values[i2].load(std::memory_order_acquire);
     }
 
     // set 时按需创建路径，避免一次性占用大内存
@@ -107,7 +142,33 @@ public:
         const Number i1 = k >> LEAF_BITS;
         const Number i2 = k & (LEAF_LENGTH - 1);
         assert(i1 < ROOT_LENGTH);
-        root_[i1]->values[i2] = v;
+        root_[i1].load(std::memory_order_relaxed)->values[i2].store(v, std::memory_order_release);
+    }
+
+    uint8_t sizeclass(Number k) const
+    {
+        const Number i1 = k >> LEAF_BITS;
+        const Number i2 = k & (LEAF_LENGTH - 1);
+        if ((k >> BITS) > 0)
+        {
+            return 0;
+        }
+
+        Leaf* leaf = root_[i1].load(std::memory_order_acquire);
+        if (leaf == NULL)
+        {
+            return 0;
+        }
+
+        return leaf->classes[i2].load(std::memory_order_acquire);
+    }
+
+    void set_sizeclass(Number k, uint8_t cl)
+    {
+        const Number i1 = k >> LEAF_BITS;
+        const Number i2 = k & (LEAF_LENGTH - 1);
+        assert(i1 < ROOT_LENGTH);
+        root_[i1].load(std::memory_order_relaxed)->classes[i2].store(cl, std::memory_order_release);
     }
 
     // 确保区间内叶子已建立，避免访问时频繁判断
@@ -124,15 +185,16 @@ public:
             }
 
             // 如果有必要，创建二级节点
-            if (root_[i1] == NULL)
+            if (root_[i1].load(std::memory_order_relaxed) == NULL)
             {
                 //Leaf* leaf = reinterpret_cast<Leaf*>((*allocator_)(sizeof(Leaf)));
                 //if (leaf == NULL) return false;
                 static ObjectPool<Leaf> leafPool;
                 Leaf* leaf = (Leaf*)leafPool.New();
 
-                memset(leaf, 0, sizeof(*leaf));
-                root_[i1] = leaf;
+                memset((void*)leaf, 0, sizeof(*leaf));
+                // 叶子清零后再发布，读者不会看到未初始化的表项
+                root_[i1].store(leaf, std::memory_order_release);
             }
 
             // 将键向前移动，越过此叶节点所覆盖的任何内容
@@ -170,13 +232,14 @@ private:
     // 内部节点
     struct Node
     {
-        Node* ptrs[INTERIOR_LENGTH];
+        std::atomic<Node*> ptrs[INTERIOR_LENGTH];
     };
 
     // 叶节点
     struct Leaf
     {
-        void* values[LEAF_LENGTH];
+        std::atomic<void*> values[LEAF_LENGTH];
+        std::atomic<uint8_t> classes[LEAF_LENGTH];
     };
 
     Node* root_;        // 基数树的根节点
@@ -189,7 +252,7 @@ private:
 
         if (result != NULL)
         {
-            memset(result, 0, sizeof(*result));
+            memset((void*)result, 0, sizeof(*result));
         }
 
         return result;
@@ -203,7 +266,7 @@ private:
 
         if (result != NULL)
         {
-            memset(result, 0, sizeof(*result));
+            memset((void*)result, 0, sizeof(*result));
         }
 
         return result;
@@ -212,6 +275,53 @@ private:
 public:
     typedef uintptr_t Number;
 
+private:
+    // 无锁找到 key 所在叶子，路径不存在返回空
+    Leaf* FindLeaf(Number k) const
+    {
+        const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
+        const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+
+        if ((k >> BITS) > 0)
+        {
+            return NULL;
+        }
+
+        // 每一层指针只读一次，避免两次读取之间被并发修改
+        Node* n = root_->ptrs[i1].load(std::memory_order_acquire);
+        if (n == NULL)
+        {
+            return NULL;
+        }
+
+        return reinterpret_cast<Leaf*>(n->ptrs[i2].load(std::memory_order_acquire));
+    }
+
+    // 写者持有 _pageMtx，读自己这一侧用 relaxed 即可；新节点清零后再 release 发布
+    Leaf* FindOrCreateLeaf(Number k)
+    {
+        assert((k >> BITS) == 0);
+        const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
+        const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+
+        Node* n = root_->ptrs[i1].load(std::memory_order_relaxed);
+        if (n == NULL)
+        {
+            n = NewNode();
+            root_->ptrs[i1].store(n, std::memory_order_release);
+        }
+
+        Node* leaf = n->ptrs[i2].load(std::memory_order_relaxed);
+        if (leaf == NULL)
+        {
+            leaf = reinterpret_cast<Node*>(NewLeaf());
+            n->ptrs[i2].store(leaf, std::memory_order_release);
+        }
+
+        return reinterpret_cast<Leaf*>(leaf);
+    }
+
+public:
     explicit TCMalloc_PageMap3()
     {
         root_ = NewNode();
@@ -220,38 +330,35 @@ public:
     // 超界直接返回空，避免野指针访问
     void* get(Number k) const
     {
-        const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
-        const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
-        const Number i3 = k & (LEAF_LENGTH - 1);
-
-        if ((k >> BITS) > 0 ||
-            root_->ptrs[i1] == NULL ||
-            root_->ptrs[i1]->ptrs[i2] == NULL) {
+        Leaf* leaf = FindLeaf(k);
+        if (leaf == NULL)
+        {
             return NULL;
         }
 
-        return reinterpret_cast<Leaf*>(root_->ptrs[i1]->ptrs[i2])->values[i3];
+        return leaf->values[k & (LEAF_LENGTH - 1)].load(std::memory_order_acquire);
     }
 
     // set 时按需创建路径，避免一次性占用大内存
     void set(Number k, void* v)
     {
-        assert((k >> BITS) == 0);
-        const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
-        const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
-        const Number i3 = k & (LEAF_LENGTH - 1);
+        FindOrCreateLeaf(k)->values[k & (LEAF_LENGTH - 1)].store(v, std::memory_order_release);
+    }
 
-        if (root_->ptrs[i1] == NULL)
+    uint8_t sizeclass(Number k) const
+    {
+        Leaf* leaf = FindLeaf(k);
+        if (leaf == NULL)
         {
-            root_->ptrs[i1] = NewNode();
+            return 0;
         }
 
-        if (root_->ptrs[i1]->ptrs[i2] == NULL)
-        {
-            root_->ptrs[i1]->ptrs[i2] = reinterpret_cast<Node*>(NewLeaf());
-        }
+        return leaf->classes[k & (LEAF_LENGTH - 1)].load(std::memory_order_acquire);
+    }
 
-        reinterpret_cast<Leaf*>(root_->ptrs[i1]->ptrs[i2])->values[i3] = v;
+    void set_sizeclass(Number k, uint8_t cl)
+    {
+        FindOrCreateLeaf(k)->classes[k & (LEAF_LENGTH - 1)].store(cl, std::memory_order_release);
     }
 
     // 确保区间内叶子已建立，避免访问时频繁判断
@@ -269,20 +376,21 @@ public:
             }
 
             // 如果有必要，创建二级节点
-            if (root_->ptrs[i1] == NULL)
+            Node* n = root_->ptrs[i1].load(std::memory_order_relaxed);
+            if (n == NULL)
             {
-                Node* n = NewNode();
+                n = NewNode();
 
                 if (n == NULL)
                 {
                     return false;
                 }
 
-                root_->ptrs[i1] = n;
+                root_->ptrs[i1].store(n, std::memory_order_release);
             }
 
             // 必要时创建叶节点
-            if (root_->ptrs[i1]->ptrs[i2] == NULL)
+            if (n->ptrs[i2].load(std::memory_order_relaxed) == NULL)
             {
                 Leaf* leaf = NewLeaf();
 
@@ -291,7 +399,7 @@ public:
                     return false;
                 }
 
-                root_->ptrs[i1]->ptrs[i2] = reinterpret_cast<Node*>(leaf);
+                n->ptrs[i2].store(reinterpret_cast<Node*>(leaf), std::memory_order_release);
             }
 
             // 将键前进到超过此叶节点所覆盖的全部内容
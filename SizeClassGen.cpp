@@ -0,0 +1,316 @@
+﻿// 尺寸类生成工具：按实际负载的申请尺寸直方图，生成内部碎片最小的尺寸类列表
+// 编译：g++ -std=c++17 -O2 SizeClassGen.cpp -o SizeClassGen
+// 用法：./SizeClassGen [-n 尺寸类个数] [--malloc] [--report] 直方图文件 > SizeClassTable.h
+//       再用 -DSIZE_CLASS_TABLE='"SizeClassTable.h"' 编译内存池，Common.h 会改用生成的列表
+//       配合 MallocOverride 使用必须加 --malloc：malloc 要求 16 字节对齐，否则 MallocOverride.cpp 编译期报错
+//       ./SizeClassGen --report 不给直方图时，输出编译进来的尺寸类的 span 末尾浪费表
+// 直方图每行“尺寸 次数”，# 开头是注释；超过 MAX_BYTES 的尺寸走页级分配，不参与生成
+#include "Common.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+
+// 默认生成的尺寸类个数，上限受页表旁路一个字节的限制
+static const size_t DEFAULT_CLASS_COUNT = 96;
+
+// 查表粒度：1KB 以内按 8 字节，以上按 128 字节，尺寸类必须落在格子边界上
+static size_t CellRoundUp(size_t size)
+{
+	size_t align = size <= SIZE_CLASS_SMALL_MAX ? ((size_t)1 << SIZE_CLASS_SMALL_SHIFT) : ((size_t)1 << SIZE_CLASS_LARGE_SHIFT);
+	return SizeClass::_RoundUp(size, align);
+}
+
+// 直方图里落在同一格的尺寸合成一个候选：只要知道次数和字节数，就能算出它们装进任意尺寸类的浪费
+struct Candidate
+{
+	size_t _size = 0;			// 格子上界，也就是可以选作尺寸类的大小
+	double _count = 0;			// 落在这一格的申请次数
+	double _bytes = 0;			// 这些申请的字节数合计
+	bool _forced = false;		// 必须保留的尺寸类
+};
+
+// 用给定的尺寸类列表（从小到大）装下直方图，返回内部碎片字节数
+static double Waste(const std::map<size_t, double>& hist, const std::vector<size_t>& classes)
+{
+	double waste = 0;
+	size_t cls = 0;
+	for (const auto& kv : hist)
+	{
+		while (classes[cls] < kv.first)
+		{
+			++cls;
+		}
+		waste += (double)(classes[cls] - kv.first) * kv.second;
+	}
+	return waste;
+}
+
+// span 末尾浪费表：每个尺寸类按批量换算的页数和 ComputeSpanPages 选出的页数各自浪费多少
+static void PrintSpanReport(FILE* out, const std::vector<size_t>& classes)
+{
+	fprintf(out, "%6s %8s | %6s %8s | %6s %6s %8s %8s\n",
+		"class", "size", "batch", "tail%", "pages", "objs", "tail", "tail%");
+
+	double batchTail = 0, batchBytes = 0, tail = 0, bytes = 0;
+	for (size_t i = 0; i < classes.size(); ++i)
+	{
+		size_t size = classes[i];
+		size_t oldPages = BatchSpanPages(size);
+		size_t oldBytes = oldPages << PAGE_SHIFT;
+		size_t pages = ComputeSpanPages(size);
+		size_t spanBytes = pages << PAGE_SHIFT;
+
+		fprintf(out, "%6zu %8zu | %6zu %7.2f%% | %6zu %6zu %8zu %7.2f%%\n",
+			i, size, oldPages, 100.0 * (double)(oldBytes % size) / (double)oldBytes,
+			pages, spanBytes / size, spanBytes % size, 100.0 * (double)(spanBytes % size) / (double)spanBytes);
+
+		batchTail += (double)(oldBytes % size);
+		batchBytes += (double)oldBytes;
+		tail += (double)(spanBytes % size);
+		bytes += (double)spanBytes;
+	}
+
+	// 每个尺寸类各算一个 span
+	fprintf(out, "span tail waste: %.2f%% with batch-derived pages, %.2f%% with chosen pages\n",
+		100.0 * batchTail / batchBytes, 100.0 * tail / bytes);
+}
+
+static void Usage()
+{
+	fprintf(stderr, "usage: SizeClassGen [-n classes] [--malloc] [--report] histogram.txt > SizeClassTable.h\n");
+	fprintf(stderr, "       SizeClassGen --report\n");
+	fprintf(stderr, "  -n classes  number of size classes to generate (default %zu, max %d)\n", DEFAULT_CLASS_COUNT, 255);
+	fprintf(stderr, "  --malloc    round sizes the way MallocOverride does (16-byte alignment above 8 bytes)\n");
+	fprintf(stderr, "  --report    print the span tail waste table (of the compiled-in classes without a histogram)\n");
+}
+
+int main(int argc, char** argv)
+{
+	size_t maxClasses = DEFAULT_CLASS_COUNT;
+	bool mallocRounding = false;
+	bool report = false;
+	const char* path = nullptr;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+		{
+			maxClasses = (size_t)strtoul(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(argv[i], "--malloc") == 0)
+		{
+			mallocRounding = true;
+		}
+		else if (strcmp(argv[i], "--report") == 0)
+		{
+			report = true;
+		}
+		else if (argv[i][0] == '-')
+		{
+			Usage();
+			return 1;
+		}
+		else
+		{
+			path = argv[i];
+		}
+	}
+
+	if (path == nullptr && report)
+	{
+		PrintSpanReport(stdout, std::vector<size_t>(kSizeClasses._sizes, kSizeClasses._sizes + NFREELISTS));
+		return 0;
+	}
+
+	if (path == nullptr || maxClasses == 0 || maxClasses > 255)
+	{
+		Usage();
+		return 1;
+	}
+
+	std::ifstream in(path);
+	if (!in)
+	{
+		fprintf(stderr, "cannot open %s\n", path);
+		return 1;
+	}
+
+	// 读直方图：尺寸 -> 次数
+	std::map<size_t, double> hist;
+	double largeCount = 0;
+	std::string line;
+	while (std::getline(in, line))
+	{
+		if (line.empty() || line[0] == '#')
+		{
+			continue;
+		}
+
+		std::istringstream ss(line);
+		size_t size = 0;
+		double count = 0;
+		if (!(ss >> size >> count) || size == 0 || count <= 0)
+		{
+			continue;
+		}
+
+		if (size > MAX_BYTES)
+		{
+			largeCount += count;
+			continue;
+		}
+		if (mallocRounding && size > 8)
+		{
+			size = SizeClass::_RoundUp(size, 16);
+		}
+		hist[size] += count;
+	}
+
+	if (hist.empty())
+	{
+		fprintf(stderr, "no allocation sizes <= %zu in %s\n", MAX_BYTES, path);
+		return 1;
+	}
+
+	// 候选尺寸类：直方图里出现过的格子，加上 8 到 MAX_BYTES 的 2 的幂作为骨架
+	// 骨架必选：直方图里没出现的尺寸也能用上，最坏浪费不到一半
+	std::map<size_t, Candidate> cells;
+	for (size_t size = 8; size <= MAX_BYTES; size <<= 1)
+	{
+		cells[size]._size = size;
+		cells[size]._forced = true;
+	}
+	for (const auto& kv : hist)
+	{
+		Candidate& c = cells[CellRoundUp(kv.first)];
+		c._size = CellRoundUp(kv.first);
+		c._count += kv.second;
+		c._bytes += (double)kv.first * kv.second;
+	}
+
+	std::vector<Candidate> cands;
+	for (const auto& kv : cells)
+	{
+		cands.push_back(kv.second);
+	}
+
+	size_t m = cands.size();
+	size_t forcedCount = 0;
+	for (const Candidate& c : cands)
+	{
+		forcedCount += c._forced ? 1 : 0;
+	}
+	if (maxClasses < forcedCount)
+	{
+		fprintf(stderr, "need at least %zu classes (powers of two from 8 to %zu)\n", forcedCount, MAX_BYTES);
+		return 1;
+	}
+	size_t k = (std::min)(maxClasses, m);
+
+	// 前缀和：候选 [0, j) 的次数和字节数，一段候选装进同一个尺寸类的浪费 O(1) 算出
+	std::vector<double> prefixCount(m + 1, 0), prefixBytes(m + 1, 0);
+	for (size_t j = 0; j < m; ++j)
+	{
+		prefixCount[j + 1] = prefixCount[j] + cands[j]._count;
+		prefixBytes[j + 1] = prefixBytes[j] + cands[j]._bytes;
+	}
+	auto segmentWaste = [&](size_t from, size_t to) {
+		// 候选 [from, to] 都装进 cands[to]
+		double count = prefixCount[to + 1] - prefixCount[from];
+		double bytes = prefixBytes[to + 1] - prefixBytes[from];
+		return (double)cands[to]._size * count - bytes;
+	};
+
+	// lastForced[j]：下标小于 j 的最后一个必选候选，上一个尺寸类不能早于它
+	std::vector<long> lastForced(m, -1);
+	for (size_t j = 1; j < m; ++j)
+	{
+		lastForced[j] = cands[j - 1]._forced ? (long)(j - 1) : lastForced[j - 1];
+	}
+
+	// dp[c][j]：用 c + 1 个尺寸类装下候选 [0, j]、最后一个尺寸类是 cands[j] 时的最小浪费
+	const double inf = std::numeric_limits<double>::infinity();
+	std::vector<std::vector<double>> dp(k, std::vector<double>(m, inf));
+	std::vector<std::vector<long>> prev(k, std::vector<long>(m, -1));
+	for (size_t j = 0; j < m; ++j)
+	{
+		if (lastForced[j] < 0)
+		{
+			dp[0][j] = segmentWaste(0, j);
+		}
+	}
+	for (size_t c = 1; c < k; ++c)
+	{
+		for (size_t j = c; j < m; ++j)
+		{
+			long lo = (std::max)(lastForced[j], (long)c - 1);
+			for (long i = lo; i < (long)j; ++i)
+			{
+				if (dp[c - 1][i] == inf)
+				{
+					continue;
+				}
+				double cost = dp[c - 1][i] + segmentWaste(i + 1, j);
+				if (cost < dp[c][j])
+				{
+					dp[c][j] = cost;
+					prev[c][j] = i;
+				}
+			}
+		}
+	}
+
+	// 尺寸类多了不会更差，但浪费相同时取少的
+	size_t best = 0;
+	for (size_t c = 1; c < k; ++c)
+	{
+		if (dp[c][m - 1] < dp[best][m - 1])
+		{
+			best = c;
+		}
+	}
+
+	std::vector<size_t> classes;
+	for (long j = (long)m - 1, c = (long)best; j >= 0; j = prev[c][j], --c)
+	{
+		classes.push_back(cands[j]._size);
+	}
+	std::reverse(classes.begin(), classes.end());
+
+	// 对比默认尺寸类
+	constexpr auto defaults = MakeDefaultSizeClasses();
+	std::vector<size_t> defaultClasses(defaults._sizes, defaults._sizes + DefaultSizeClassCount());
+	double totalCount = prefixCount[m];
+	double totalBytes = prefixBytes[m];
+	double generatedWaste = Waste(hist, classes);
+	double defaultWaste = Waste(hist, defaultClasses);
+
+	fprintf(stderr, "%.0f allocations (%.0f bytes) <= %zu bytes, %.0f larger ones ignored\n",
+		totalCount, totalBytes, MAX_BYTES, largeCount);
+	fprintf(stderr, "default:   %3zu classes, internal fragmentation %.2f%%\n",
+		defaultClasses.size(), 100.0 * defaultWaste / (totalBytes + defaultWaste));
+	fprintf(stderr, "generated: %3zu classes, internal fragmentation %.2f%%\n",
+		classes.size(), 100.0 * generatedWaste / (totalBytes + generatedWaste));
+	if (report)
+	{
+		PrintSpanReport(stderr, classes);
+	}
+
+	// 输出头文件：Common.h 在 SizeClassList 定义之后包含它
+	printf("\xEF\xBB\xBF// 由 SizeClassGen 根据 %s 生成，不要手工修改\n", path);
+	printf("// %zu 个尺寸类，按直方图估算的内部碎片 %.2f%%（默认尺寸类 %.2f%%）\n",
+		classes.size(), 100.0 * generatedWaste / (totalBytes + generatedWaste),
+		100.0 * defaultWaste / (totalBytes + defaultWaste));
+	printf("static constexpr SizeClassList<%zu> kSizeClasses = { {", classes.size());
+	for (size_t i = 0; i < classes.size(); ++i)
+	{
+		printf("%s%zu%s", i % 8 == 0 ? "\n\t" : " ", classes[i], i + 1 < classes.size() ? "," : "");
+	}
+	printf("\n} };\n");
+
+	return 0;
+}
@@ -0,0 +1,193 @@
+﻿#pragma once
+#include "Common.h"
+
+// 空闲大 span（>= NPAGES 页）的有序集合：侵入式 treap，节点就是 Span 本身，不额外分配内存
+// 键为 (页数, 起始页号)：最佳适配取页数最小的，页数相同取地址最低的，让大块内存尽量从低地址紧凑使用
+// 优先级由页号哈希得到，期望高度 O(log n)
+// 需在 PageCache::_pageMtx 下使用
+class SpanTree
+{
+public:
+	bool Empty() const
+	{
+		return _root == nullptr;
+	}
+
+	void Insert(Span* span)
+	{
+		assert(span->_left == nullptr && span->_right == nullptr);
+		_root = InsertNode(_root, span);
+	}
+
+	void Erase(Span* span)
+	{
+		_root = EraseNode(_root, span);
+		span->_left = nullptr;
+		span->_right = nullptr;
+	}
+
+	// 找页数 >= k 的最佳适配 span，没有返回 nullptr
+	Span* BestFit(size_t k) const
+	{
+		Span* best = nullptr;
+		Span* cur = _root;
+		while (cur != nullptr)
+		{
+			if (cur->_n >= k)
+			{
+				// cur 满足条件，左子树里可能还有更小的
+				best = cur;
+				cur = cur->_left;
+			}
+			else
+			{
+				cur = cur->_right;
+			}
+		}
+
+		return best;
+	}
+
+	// 页数最多的 span（页数相同取地址最高的），空树返回 nullptr
+	Span* Largest() const
+	{
+		Span* cur = _root;
+		while (cur != nullptr && cur->_right != nullptr)
+		{
+			cur = cur->_right;
+		}
+
+		return cur;
+	}
+
+	// 中序遍历（按页数从小到大），供统计、回收等策略使用
+	template<class Func>
+	void ForEach(Func func) const
+	{
+		ForEachNode(_root, func);
+	}
+
+private:
+	static bool KeyLess(const Span* a, const Span* b)
+	{
+		if (a->_n != b->_n)
+		{
+			return a->_n < b->_n;
+		}
+
+		return a->_pageId < b->_pageId;
+	}
+
+	static uint64_t Priority(const Span* span)
+	{
+		// 空闲 span 的起始页号互不相同，乘法哈希打散即可当作随机优先级
+		return (uint64_t)span->_pageId * 0x9E3779B97F4A7C15ull;
+	}
+
+	// 按 key 把 t 拆成 < key 和 >= key 两棵树
+	static void Split(Span* t, const Span* key, Span*& l, Span*& r)
+	{
+		if (t == nullptr)
+		{
+			l = r = nullptr;
+			return;
+		}
+
+		if (KeyLess(t, key))
+		{
+			Split(t->_right, key, t->_right, r);
+			l = t;
+		}
+		else
+		{
+			Split(t->_left, key, l, t->_left);
+			r = t;
+		}
+	}
+
+	// 合并两棵树，要求 l 的所有键都小于 r
+	static Span* Merge(Span* l, Span* r)
+	{
+		if (l == nullptr)
+		{
+			return r;
+		}
+		if (r == nullptr)
+		{
+			return l;
+		}
+
+		if (Priority(l) > Priority(r))
+		{
+			l->_right = Merge(l->_right, r);
+			return l;
+		}
+		else
+		{
+			r->_left = Merge(l, r->_left);
+			return r;
+		}
+	}
+
+	static Span* InsertNode(Span* t, Span* node)
+	{
+		if (t == nullptr)
+		{
+			return node;
+		}
+
+		if (Priority(node) > Priority(t))
+		{
+			Split(t, node, node->_left, node->_right);
+			return node;
+		}
+
+		if (KeyLess(node, t))
+		{
+			t->_left = InsertNode(t->_left, node);
+		}
+		else
+		{
+			t->_right = InsertNode(t->_right, node);
+		}
+
+		return t;
+	}
+
+	static Span* EraseNode(Span* t, Span* node)
+	{
+		assert(t != nullptr);
+
+		if (t == node)
+		{
+			return Merge(t->_left, t->_right);
+		}
+
+		if (KeyLess(node, t))
+		{
+			t->_left = EraseNode(t->_left, node);
+		}
+		else
+		{
+			t->_right = EraseNode(t->_right, node);
+		}
+
+		return t;
+	}
+
+	template<class Func>
+	static void ForEachNode(Span* t, Func& func)
+	{
+		if (t == nullptr)
+		{
+			return;
+		}
+
+		ForEachNode(t->_left, func);
+		func(t);
+		ForEachNode(t->_right, func);
+	}
+
+private:
+	Span* _root = nullptr;
+};
@@ -1,8 +1,134 @@
 ﻿#include "ThreadCache.h"
 #include "CentralCache.h"
+#include "TransferCache.h"
+#include "AllocatorStats.h"
+#include "HeapProfiler.h"
 
 // 线程局部存储实例只定义一次，避免跨编译单元重复
-thread_local ThreadCache* pTLSThreadCache = nullptr;
+TLS_POD ThreadCache* pTLSThreadCache = nullptr;
+TLS_POD bool tlsThreadCacheDestroyed = false;
+TLS_POD bool tlsThreadCacheInitializing = false;
+
+// 所有存活的 ThreadCache 串成链表，统计时遍历；已退出线程的慢路径次数并到这里
+static std::mutex sCacheListMtx;
+static ThreadCache* sCacheList = nullptr;
+static size_t sExitedMisses[NFREELISTS] = { 0 };
+
+// 线程缓存的总预算和还没分给任何线程的部分，由 sCacheListMtx 保护
+// 每个线程至少有 THREAD_CACHE_MIN_BYTES，线程太多时未分配的部分会是负数，之后只能靠偷
+static size_t sOverallBudget = THREAD_CACHE_DEFAULT_BUDGET;
+static int64_t sUnclaimedBudget = THREAD_CACHE_DEFAULT_BUDGET;
+// 下一个被偷的线程，轮流偷，不总盯着同一个
+static ThreadCache* sNextVictim = nullptr;
+
+ThreadCache::ThreadCache()
+{
+	// 各线程的随机数种子不同，采样点就不会在线程间同步
+	_sampleRng = (uint64_t)(uintptr_t)this * 0x9E3779B97F4A7C15ull + (uint64_t)time(nullptr);
+	_sampleRng |= 1;
+	_bytesUntilSample = HeapProfiler::GetInstance()->NextSampleInterval(_sampleRng);
+
+	std::lock_guard<std::mutex> lock(sCacheListMtx);
+	// 新线程的下限也从总预算里出：不够就从别的线程偷，实在偷不到才超出总预算
+	size_t claimed = ClaimBudget(THREAD_CACHE_MIN_BYTES);
+	sUnclaimedBudget -= (int64_t)(THREAD_CACHE_MIN_BYTES - (std::min)(claimed, THREAD_CACHE_MIN_BYTES));
+	_maxBytes.store((std::max)(claimed, THREAD_CACHE_MIN_BYTES), std::memory_order_relaxed);
+
+	_nextCache = sCacheList;
+	if (sCacheList != nullptr)
+	{
+		sCacheList->_prevCache = this;
+	}
+	sCacheList = this;
+}
+
+ThreadCache::~ThreadCache()
+{
+	// 线程退出钩子：thread_local 对象析构时把每个桶整条链表还给 CentralCache
+	// span 的对象全部回来后会继续还给 PageCache 合并，内存可以被其他线程复用
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		FreeList& list = _freeLists[i];
+		if (list.Empty())
+		{
+			continue;
+		}
+
+		void* start = nullptr;
+		void* end = nullptr;
+		list.PopRange(start, end, list.Size());
+		CentralCache::GetInstance()->ReleaseListToSpans(start, SizeClass::ClassSize(i));
+	}
+
+	// 从链表摘下，之后统计不会再读到这个对象
+	{
+		std::lock_guard<std::mutex> lock(sCacheListMtx);
+		for (size_t i = 0; i < NFREELISTS; ++i)
+		{
+			sExitedMisses[i] += _misses[i].load(std::memory_order_relaxed);
+		}
+
+		// 上限还回总预算，留给其他线程
+		sUnclaimedBudget += (int64_t)_maxBytes.load(std::memory_order_relaxed);
+		if (sNextVictim == this)
+		{
+			sNextVictim = _nextCache;
+		}
+
+		if (_prevCache != nullptr)
+		{
+			_prevCache->_nextCache = _nextCache;
+		}
+		else
+		{
+			sCacheList = _nextCache;
+		}
+		if (_nextCache != nullptr)
+		{
+			_nextCache->_prevCache = _prevCache;
+		}
+	}
+
+	// 之后本线程再来的申请/释放走 *WithoutCache，不能再碰已析构的对象
+	pTLSThreadCache = nullptr;
+	tlsThreadCacheDestroyed = true;
+}
+
+void* ThreadCache::AllocateWithoutCache(size_t size)
+{
+	assert(size <= MAX_BYTES);
+
+	// 一次只拿一个，不在已经退出的线程上囤积内存
+	void* start = nullptr;
+	void* end = nullptr;
+	size_t actualNum = CentralCache::GetInstance()->FetchRangeObj(start, end, 1, SizeClass::RoundUp(size));
+	assert(actualNum == 1);
+	(void)actualNum;
+
+	return start;
+}
+
+void ThreadCache::DeallocateWithoutCache(void* ptr, size_t size)
+{
+	assert(ptr);
+	assert(size <= MAX_BYTES);
+
+	NextObj(ptr) = nullptr;
+	CentralCache::GetInstance()->ReleaseListToSpans(ptr, size);
+}
+
+void ThreadCache::DeallocateBatchWithoutCache(void** ptrs, size_t n, size_t size)
+{
+	assert(n > 0);
+	assert(size <= MAX_BYTES);
+
+	for (size_t i = 0; i + 1 < n; ++i)
+	{
+		NextObj(ptrs[i]) = ptrs[i + 1];
+	}
+	NextObj(ptrs[n - 1]) = nullptr;
+	CentralCache::GetInstance()->ReleaseListToSpans(ptrs[0], size);
+}
 
 void* ThreadCache::FetchFromCentralCache(size_t index, size_t size)
 {
@@ -12,18 +138,34 @@ void* ThreadCache::FetchFromCentralCache(size_t index, size_t size)
 	// 3. size 越大，一次向 central cache 要的 batchNum 就越小
 	// 4. size 越小，一次向 central cache 要的 batchNum 就越大
 	// 批量大小受桶阈值和全局上限双重约束，避免一次拿太多
-	size_t batchNum = min(_freeLists[index].MaxSize(), SizeClass::NumMoveSize(size));
-	if (_freeLists[index].MaxSize() == batchNum)
+	FreeList& list = _freeLists[index];
+	size_t moveNum = SizeClass::NumMoveSize(size);
+	size_t batchNum = (std::min)(list.MaxSize(), moveNum);
+	if (list.MaxSize() < moveNum)
 	{
 		// 逐步放大批量，常用 size 会越来越“省锁”
-		_freeLists[index].MaxSize() += 1;
+		list.MaxSize() += 1;
 	}
+	else
+	{
+		// 批量已经到顶还在落空：本地装不下这个线程的工作集，长度上限再放宽一批
+		list.MaxSize() = (std::min)(list.MaxSize() + moveNum, (std::max)(FREELIST_MAX_LENGTH, moveNum));
+	}
+	// 有落空说明缓存的对象确实被用掉了，之前的溢出不算“囤得太多”
+	list.Overflows() = 0;
+
+	CountMiss(index);
 
 	void* start = nullptr;
 	void* end = nullptr;
 
-	// CentralCache 只在桶锁范围内批量取，减少锁持有时间
-	size_t actualNum = CentralCache::GetInstance()->FetchRangeObj(start, end, batchNum, size);
+	// 先找中转缓存要别的线程整批还回来的对象，O(1) 且不碰 Span
+	size_t actualNum = TransferCache::GetInstance()->RemoveRange(index, start, end, batchNum);
+	if (actualNum == 0)
+	{
+		// CentralCache 只在桶锁范围内批量取，减少锁持有时间
+		actualNum = CentralCache::GetInstance()->FetchRangeObj(start, end, batchNum, size);
+	}
 	assert(actualNum > 0);
 
 	if (actualNum == 1)
@@ -34,23 +176,43 @@ void* ThreadCache::FetchFromCentralCache(size_t index, size_t size)
 	else
 	{
 		// 留一个给当前请求，其余挂到本线程 freelist，减少后续锁开销
-		_freeLists[index].PushRange(NextObj(start), end, actualNum - 1);
+		list.PushRange(NextObj(start), end, actualNum - 1);
+		_bytes += (actualNum - 1) * size;
+
+		// 上限可能被别的线程偷走了一部分，在慢路径上收缩
+		if (_bytes > _maxBytes.load(std::memory_order_relaxed))
+		{
+			Scavenge();
+		}
 		return start;
 	}
 
 }
 
 
-void* ThreadCache::Allocate(size_t size)
+bool ThreadCache::ResetSampleCounter()
 {
-	assert(size <= MAX_BYTES);
+	_bytesUntilSample = HeapProfiler::GetInstance()->NextSampleInterval(_sampleRng);
+	return HeapProfiler::GetInstance()->SampleRate() != 0;
+}
 
-	// 对齐后的 size 决定桶大小，原始 size 只用于算桶号
-	size_t alignedSize = SizeClass::RoundUp(size);
-	size_t index = SizeClass::Index(size);
+void* ThreadCache::AllocateSlow(size_t index, size_t size)
+{
+	// 堆采样：采中的对象单独分配并记录调用栈
+	if (_bytesUntilSample < 0 && ResetSampleCounter())
+	{
+		void* ptr = HeapProfiler::GetInstance()->AllocateSampled(size, 1);
+		if (ptr != nullptr)
+		{
+			return ptr;
+		}
+	}
 
+	// 对齐后的 size 决定桶大小，原始 size 只用于算桶号
+	size_t alignedSize = SizeClass::ClassSize(index);
 	if (!_freeLists[index].Empty())
 	{
+		_bytes -= alignedSize;
 		return _freeLists[index].Pop();
 	}
 	else
@@ -60,29 +222,271 @@ void* ThreadCache::Allocate(size_t size)
 	}
 }
 
-void ThreadCache::Deallocate(void* ptr, size_t size)
+void ThreadCache::DeallocateSlow(FreeList& list, size_t size)
+{
+	// 当链表长度大于一次批量申请的内存时就开始还一段 list 给 central cache
+	if (list.Size() >= list.MaxSize())
+	{
+		// 防止线程独占过多内存，留给其他线程用
+		ListTooLong(list, size);
+	}
+	if (_bytes > _maxBytes.load(std::memory_order_relaxed))
+	{
+		// 整个线程缓存超出上限：各桶都收缩一些，再向全局要预算
+		Scavenge();
+	}
+}
+
+void ThreadCache::AllocateBatch(size_t size, size_t n, void** out)
 {
-	assert(ptr);
 	assert(size <= MAX_BYTES);
 
-	// 找出对应的自由链表桶，将对象插入进去
+	size_t got = 0;
+
+	// 堆采样按整批的字节数计数，采中时只采其中一个
+	if (n > 0 && PickSample(size * n))
+	{
+		void* ptr = HeapProfiler::GetInstance()->AllocateSampled(size, 1);
+		if (ptr != nullptr)
+		{
+			out[got++] = ptr;
+		}
+	}
+
+	size_t alignedSize = SizeClass::RoundUp(size);
 	size_t index = SizeClass::Index(size);
-	_freeLists[index].Push(ptr);
+	FreeList& list = _freeLists[index];
 
-	// 当链表长度大于一次批量申请的内存时就开始还一段 list 给 central cache
-	if (_freeLists[index].Size() >= _freeLists[index].MaxSize())
+	size_t popped = got;
+	while (got < n && !list.Empty())
 	{
-		// 防止线程独占过多内存，留给其他线程用
-		ListTooLong(_freeLists[index], size);
+		out[got++] = list.Pop();
+	}
+	_bytes -= (got - popped) * alignedSize;
+	if (got == n)
+	{
+		return;
+	}
+
+	CountMiss(index);
+
+	// 成批申请的尺寸类也会成批释放：慢启动阈值直接提到能放下一整批（不超过批量上限），
+	// 这一批还回来时留在本地，下一批就不用再出线程
+	size_t want = (std::min)(n + 1, SizeClass::NumMoveSize(alignedSize));
+	if (list.MaxSize() < want)
+	{
+		list.MaxSize() = want;
+	}
+
+	// 先拿中转缓存里别的线程还回来的整批，剩下的一次向中心缓存要齐
+	while (got < n)
+	{
+		void* start = nullptr;
+		void* end = nullptr;
+		size_t actualNum = TransferCache::GetInstance()->RemoveRange(index, start, end, n - got);
+		if (actualNum == 0)
+		{
+			actualNum = CentralCache::GetInstance()->FetchRangeObj(start, end, n - got, alignedSize);
+		}
+
+		for (void* obj = start; obj != nullptr; obj = NextObj(obj))
+		{
+			out[got++] = obj;
+		}
+	}
+}
+
+void ThreadCache::DeallocateBatch(void** ptrs, size_t n, size_t size)
+{
+	assert(n > 0);
+	assert(size <= MAX_BYTES);
+
+	for (size_t i = 0; i + 1 < n; ++i)
+	{
+		NextObj(ptrs[i]) = ptrs[i + 1];
+	}
+
+	size_t index = SizeClass::Index(size);
+	FreeList& list = _freeLists[index];
+	list.PushRange(ptrs[0], ptrs[n - 1], n);
+	_bytes += n * SizeClass::ClassSize(index);
+
+	// 一次挂进来的可能远超阈值，ListTooLong 按批还到低于阈值为止，每批都能被中转缓存整批接住
+	if (list.Size() >= list.MaxSize())
+	{
+		ListTooLong(list, size);
+	}
+	if (_bytes > _maxBytes.load(std::memory_order_relaxed))
+	{
+		Scavenge();
 	}
 }
 
 void ThreadCache::ListTooLong(FreeList& list, size_t size)
+{
+	size_t index = SizeClass::Index(size);
+	size_t moveNum = SizeClass::NumMoveSize(size);
+	CountMiss(index);
+
+	// 每次最多还一批，并且留下上限的一半作为工作集：
+	// 在阈值附近来回申请释放时，刚还完不会马上落空，刚取回也不会马上溢出
+	while (list.Size() >= list.MaxSize())
+	{
+		size_t keep = list.MaxSize() / 2;
+		ReleaseFromList(index, (std::min)(list.Size() - keep, moveNum));
+	}
+
+	if (list.MaxSize() < moveNum)
+	{
+		// 还在慢启动：和落空一样放大一点
+		list.MaxSize() += 1;
+	}
+	else if (++list.Overflows() > FREELIST_MAX_OVERFLOWS)
+	{
+		// 只溢出不落空：这个线程释放得比申请得多，长度上限收回一批，不在本地囤对象
+		list.MaxSize() = (std::max)(list.MaxSize() - moveNum, moveNum);
+		list.Overflows() = 0;
+	}
+}
+
+void ThreadCache::ReleaseFromList(size_t index, size_t n)
 {
 	void* start = nullptr;
 	void* end = nullptr;
+	size_t size = SizeClass::ClassSize(index);
+
+	_freeLists[index].PopRange(start, end, n);
+	_bytes -= n * size;
 
-	// 批量归还，减少反复加锁
-	list.PopRange(start, end, list.MaxSize());
-	CentralCache::GetInstance()->ReleaseListToSpans(start, size);
-}
\ No newline at end of file
+	// 整批先交给中转缓存，留给其他线程直接取走；中转缓存满了再拆回 span
+	if (!TransferCache::GetInstance()->InsertRange(index, start, end, n))
+	{
+		CentralCache::GetInstance()->ReleaseListToSpans(start, size);
+	}
+}
+
+void ThreadCache::Scavenge()
+{
+	// 收缩到上限的 3/4 就停：够用就不再动别的桶，留出的余量也让接下来的释放不会马上又回到这里拿全局锁
+	size_t target = _maxBytes.load(std::memory_order_relaxed) / 4 * 3;
+	while (_bytes > target)
+	{
+		// 每个桶还一半（向上取整），常用的桶剩下的一半还够用一阵
+		size_t i = _scavengeIndex;
+		_scavengeIndex = (i + 1) % NFREELISTS;
+
+		size_t n = _freeLists[i].Size();
+		if (n > 0)
+		{
+			ReleaseFromList(i, (n + 1) / 2);
+		}
+	}
+
+	IncreaseCacheLimit();
+}
+
+void ThreadCache::IncreaseCacheLimit()
+{
+	std::lock_guard<std::mutex> lock(sCacheListMtx);
+
+	size_t claimed = ClaimBudget(THREAD_CACHE_STEAL_BYTES);
+	_maxBytes.store(_maxBytes.load(std::memory_order_relaxed) + claimed, std::memory_order_relaxed);
+}
+
+size_t ThreadCache::ClaimBudget(size_t want)
+{
+	size_t claimed = 0;
+	if (sUnclaimedBudget > 0)
+	{
+		claimed = (std::min)((size_t)sUnclaimedBudget, want);
+		sUnclaimedBudget -= (int64_t)claimed;
+	}
+
+	// 预算分完了：从别的线程偷，对方下次走慢路径时发现超出上限，自己收缩
+	// 最多看 10 个线程，都已经在下限上就算了
+	for (int i = 0; i < 10 && claimed < want && sCacheList != nullptr; ++i)
+	{
+		if (sNextVictim == nullptr)
+		{
+			sNextVictim = sCacheList;
+		}
+
+		ThreadCache* victim = sNextVictim;
+		sNextVictim = victim->_nextCache;
+		if (victim == this)
+		{
+			continue;
+		}
+
+		size_t victimMax = victim->_maxBytes.load(std::memory_order_relaxed);
+		if (victimMax >= THREAD_CACHE_MIN_BYTES + THREAD_CACHE_STEAL_BYTES)
+		{
+			victim->_maxBytes.store(victimMax - THREAD_CACHE_STEAL_BYTES, std::memory_order_relaxed);
+			claimed += THREAD_CACHE_STEAL_BYTES;
+		}
+	}
+
+	return claimed;
+}
+
+void ThreadCache::SetOverallBudget(size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(sCacheListMtx);
+
+	size_t claimed = 0;
+	for (ThreadCache* tc = sCacheList; tc != nullptr; tc = tc->_nextCache)
+	{
+		claimed += tc->_maxBytes.load(std::memory_order_relaxed);
+	}
+
+	// 已分出去的超过新的总上限：各线程按比例调小（不低于下限）
+	if (claimed > bytes)
+	{
+		double ratio = (double)bytes / (double)claimed;
+		claimed = 0;
+		for (ThreadCache* tc = sCacheList; tc != nullptr; tc = tc->_nextCache)
+		{
+			size_t maxBytes = (size_t)((double)tc->_maxBytes.load(std::memory_order_relaxed) * ratio);
+			maxBytes = (std::max)(maxBytes, THREAD_CACHE_MIN_BYTES);
+			tc->_maxBytes.store(maxBytes, std::memory_order_relaxed);
+			claimed += maxBytes;
+		}
+	}
+
+	sOverallBudget = bytes;
+	sUnclaimedBudget = (int64_t)bytes - (int64_t)claimed;
+}
+
+void ThreadCache::CollectStats(AllocatorStats& stats)
+{
+	std::lock_guard<std::mutex> lock(sCacheListMtx);
+
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		stats._classes[i]._threadCacheMisses += sExitedMisses[i];
+	}
+	stats._threadCacheBudget = sOverallBudget;
+
+	// 其他线程的 FreeList 长度和计数只用 relaxed 读，读到的是某个时刻的值
+	for (ThreadCache* tc = sCacheList; tc != nullptr; tc = tc->_nextCache)
+	{
+		++stats._threadCaches;
+		stats._threadCacheLimitBytes += tc->_maxBytes.load(std::memory_order_relaxed);
+		for (size_t i = 0; i < NFREELISTS; ++i)
+		{
+			SizeClassStats& cls = stats._classes[i];
+			cls._threadCacheBytes += tc->_freeLists[i].Size() * SizeClass::ClassSize(i);
+			cls._threadCacheMisses += tc->_misses[i].load(std::memory_order_relaxed);
+		}
+	}
+}
+
+void ThreadCache::LockAll()
+{
+	sCacheListMtx.lock();
+}
+
+void ThreadCache::UnlockAll()
+{
+	sCacheListMtx.unlock();
+}
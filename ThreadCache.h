@@ -1,25 +1,150 @@
 ﻿#pragma once
 #include "Common.h"
 
+struct AllocatorStats;
+
+// 所有线程缓存合计最多缓存的字节数（默认值），可以用 ConcurrentSetThreadCacheBudget 调整
+static const size_t THREAD_CACHE_DEFAULT_BUDGET = 32 * 1024 * 1024;
+// 单个线程缓存上限的下限：新线程先拿这么多，被别的线程偷也不会低于它
+static const size_t THREAD_CACHE_MIN_BYTES = 64 * 1024;
+// 线程缓存不够用时，一次从未分配的预算或者别的线程那里拿这么多
+static const size_t THREAD_CACHE_STEAL_BYTES = 64 * 1024;
+
+// 单个桶的长度上限最多长到这么多个对象，总字节数另由线程缓存预算约束
+static const size_t FREELIST_MAX_LENGTH = 8192;
+// 连续溢出这么多次（中间没有落空）就把桶的长度上限减一批
+static const size_t FREELIST_MAX_OVERFLOWS = 3;
+
 class ThreadCache
 {
 public:
-	// 申请和释放内存对象
-	void* Allocate(size_t size);
-	void Deallocate(void* ptr, size_t size);
+	// 登记到全局链表，统计时按需遍历各线程的计数
+	ThreadCache();
+
+	// 线程退出时把所有桶里的对象还给中心缓存，避免线程频繁创建销毁时内存只涨不降
+	~ThreadCache();
+
+	// 申请和释放内存对象：快路径内联在调用方，只有一次查表、一次采样计数和一次链表弹出/压入
+	void* Allocate(size_t size)
+	{
+		assert(size <= MAX_BYTES);
+
+		size_t index = SizeClass::Index(size);
+		FreeList& list = _freeLists[index];
+
+		// 没采中且本地有货：直接弹出；其余情况（采样、落空）都交给慢路径
+		_bytesUntilSample -= (int64_t)size;
+		if (_bytesUntilSample >= 0 && !list.Empty())
+		{
+			_bytes -= SizeClass::ClassSize(index);
+			return list.Pop();
+		}
+
+		return AllocateSlow(index, size);
+	}
+
+	// 堆采样计数：平均每申请 N 字节返回一次 true；没采中时只是一次减法和一次判断
+	bool PickSample(size_t size)
+	{
+		_bytesUntilSample -= (int64_t)size;
+		return _bytesUntilSample < 0 && ResetSampleCounter();
+	}
+	void Deallocate(void* ptr, size_t size)
+	{
+		assert(ptr);
+		assert(size <= MAX_BYTES);
+
+		// 找出对应的自由链表桶，将对象插入进去
+		size_t index = SizeClass::Index(size);
+		FreeList& list = _freeLists[index];
+		list.Push(ptr);
+		_bytes += SizeClass::ClassSize(index);
+
+		// 链表超过阈值、或者整个线程缓存超过上限，才需要往回还
+		if (list.Size() >= list.MaxSize() || _bytes > _maxBytes.load(std::memory_order_relaxed))
+		{
+			DeallocateSlow(list, size);
+		}
+	}
+
+	// 批量申请 n 个同尺寸对象：先从本地链表弹，不够的部分一次向中转缓存/中心缓存要齐
+	void AllocateBatch(size_t size, size_t n, void** out);
+	// 批量释放 n 个同尺寸类的对象：串成一条链表整段挂到本地链表，超出阈值再按批归还
+	void DeallocateBatch(void** ptrs, size_t n, size_t size);
+
+	// 本线程的 ThreadCache 已经析构（其他线程局部对象析构时还在分配/释放），直接和中心缓存交互
+	static void* AllocateWithoutCache(size_t size);
+	static void DeallocateWithoutCache(void* ptr, size_t size);
+	static void DeallocateBatchWithoutCache(void** ptrs, size_t n, size_t size);
 
 	// 从中心缓存获取对象
 	void* FetchFromCentralCache(size_t index, size_t size);
 
-	// 释放对象时，链表过长时，回收内存回到中心缓存
+	// 释放对象时，链表过长时，回收内存回到中心缓存：每次最多还一批，留下一半工作集，并按溢出情况调整桶的长度上限
 	void ListTooLong(FreeList& list, size_t size);
+
+	// 累加所有线程缓存里的对象和慢路径次数（已退出线程的次数也算上）
+	static void CollectStats(AllocatorStats& stats);
+
+	// fork 前后调用，加锁/解锁全局 ThreadCache 链表
+	static void LockAll();
+	static void UnlockAll();
+
+	// 调整所有线程缓存合计的字节上限：总上限变小时按比例调小各线程的上限，各线程下次走慢路径时收缩
+	static void SetOverallBudget(size_t bytes);
 private:
+	// Allocate 的慢路径：这次采中了，或者本地链表空了（采样计数已经减过）
+	void* AllocateSlow(size_t index, size_t size);
+	// Deallocate 的慢路径：对象已经压进 list
+	void DeallocateSlow(FreeList& list, size_t size);
+
+	// 从一个桶里摘 n 个对象还回去（中转缓存放不下再还给中心缓存）
+	void ReleaseFromList(size_t index, size_t n);
+
+	// 缓存的字节数超过本线程上限：从上次停下的桶起逐个还一半，降到上限的 3/4 就停，然后尝试把上限调大
+	void Scavenge();
+
+	// 本线程缓存不够用：先拿未分配的预算，没有就轮流从别的线程那里偷一点
+	void IncreaseCacheLimit();
+	// 需持有 sCacheListMtx：从未分配的预算和别的线程那里凑最多 want 字节，返回凑到的
+	size_t ClaimBudget(size_t want);
+
+	// 只有本线程写，统计时别的线程读，同 FreeList 的 _size
+	void CountMiss(size_t index)
+	{
+		_misses[index].store(_misses[index].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	// 计数器用完：重新抽下一次的间隔，返回采样是否打开
+	bool ResetSampleCounter();
+
 	// 每个桶只被当前线程访问，无需加锁
 	FreeList _freeLists[NFREELISTS];
+
+	// 各桶缓存的字节数合计，只有本线程读写
+	size_t _bytes = 0;
+	// 本线程的缓存上限：别的线程偷预算时会调小它，写都在 sCacheListMtx 下
+	std::atomic<size_t> _maxBytes{ 0 };
+	// Scavenge 下次从哪个桶开始还，各桶轮流收缩
+	size_t _scavengeIndex = 0;
+
+	// 距离下一次堆采样还要申请的字节数，以及抽间隔用的随机数状态
+	int64_t _bytesUntilSample = 0;
+	uint64_t _sampleRng = 0;
+	// 每个桶走慢路径的次数
+	std::atomic<size_t> _misses[NFREELISTS] = {};
+
+	// 全局 ThreadCache 链表，由 ThreadCache.cpp 里的锁保护
+	ThreadCache* _prevCache = nullptr;
+	ThreadCache* _nextCache = nullptr;
 };
 
 
 // 线程局部存储指针声明：每个线程只绑定一个 ThreadCache 实例
 // 头文件只声明线程局部存储指针，避免跨编译单元多份实例
-extern thread_local ThreadCache* pTLSThreadCache;
+extern TLS_POD ThreadCache* pTLSThreadCache;
+// 本线程的 ThreadCache 是否已经析构，析构后不能再通过 thread_local 拿到它
+extern TLS_POD bool tlsThreadCacheDestroyed;
+// 本线程正在构造 ThreadCache：登记析构钩子时 C 库会再申请内存，这期间不能再去拿 thread_local
+extern TLS_POD bool tlsThreadCacheInitializing;
 
@@ -0,0 +1,340 @@
+﻿// 轨迹重放工具：把 USE_ALLOC_TRACE 录下的申请释放轨迹按原来的线程数重新执行一遍，对比内存池和系统 malloc
+// 编译：g++ -std=c++17 -O2 -pthread TraceReplay.cpp <内存池除 UnitTest/Benchmark/SizeClassGen/MallocOverride 外的 .cpp> -o TraceReplay
+// 录制：用 -DUSE_ALLOC_TRACE 编译内存池，程序里调 ConcurrentStartTrace / ConcurrentStopTrace，
+//       或者替换 malloc 时设置环境变量 CM_ALLOC_TRACE=文件名，从加载起录到进程退出
+// 用法：./TraceReplay [--system] trace.bin          重放并输出耗时和内存占用，--system 改用系统 malloc/free
+//       ./TraceReplay --histogram trace.bin > hist.txt   输出申请尺寸直方图，交给 SizeClassGen 生成尺寸类
+// 重放不等待原来的时间间隔，每个线程按时间顺序连续执行自己的操作；释放别的线程申请的对象时，等对方申请完再释放
+#include "ConcurrentAlloc.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+// 重放时一个线程的一步操作，对象已经换成从 0 开始的编号
+struct ReplayOp
+{
+	uint64_t _object;
+	size_t _size;
+	TraceOp _op;
+};
+
+// 读入并整理后的轨迹
+struct ReplayTrace
+{
+	std::vector<std::vector<ReplayOp>> _threads;	// 按线程分组，组内按时间排序
+	size_t _objects = 0;							// 对象个数
+	size_t _allocs = 0;
+	size_t _frees = 0;
+	size_t _unknownFrees = 0;						// 释放了开始记录前申请的对象，重放时跳过
+	size_t _lostFrees = 0;							// 地址没释放就又被申请（释放没记上），旧对象重放时不释放
+	double _seconds = 0;							// 轨迹本身的时长
+};
+
+static bool ReadTrace(const char* path, std::vector<TraceRecord>& records)
+{
+	FILE* f = fopen(path, "rb");
+	if (f == nullptr)
+	{
+		fprintf(stderr, "cannot open %s\n", path);
+		return false;
+	}
+
+	TraceHeader header;
+	if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header._magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0
+		|| header._version != TRACE_VERSION || header._recordSize != sizeof(TraceRecord))
+	{
+		fprintf(stderr, "%s is not a trace file of this version\n", path);
+		fclose(f);
+		return false;
+	}
+
+	TraceRecord buf[4096];
+	size_t n = 0;
+	while ((n = fread(buf, sizeof(TraceRecord), sizeof(buf) / sizeof(buf[0]), f)) > 0)
+	{
+		records.insert(records.end(), buf, buf + n);
+	}
+	fclose(f);
+
+	// 各线程的缓冲整块写入，文件里不按时间排序
+	std::stable_sort(records.begin(), records.end(), [](const TraceRecord& a, const TraceRecord& b) {
+		return a._time < b._time;
+	});
+	return true;
+}
+
+// 按时间顺序把地址换成对象编号，同一地址每申请一次就是一个新对象；再按线程分组
+static ReplayTrace BuildReplay(const std::vector<TraceRecord>& records)
+{
+	ReplayTrace trace;
+	std::unordered_map<uint64_t, uint64_t> live;		// 地址 -> 当前占用它的对象
+	std::unordered_map<uint32_t, size_t> threads;		// 记录的线程号 -> 重放线程下标，按第一次出现的顺序
+
+	for (const TraceRecord& r : records)
+	{
+		auto it = threads.find(r.Thread());
+		if (it == threads.end())
+		{
+			it = threads.emplace(r.Thread(), trace._threads.size()).first;
+			trace._threads.emplace_back();
+		}
+		std::vector<ReplayOp>& ops = trace._threads[it->second];
+
+		if (r.Op() == TRACE_ALLOC)
+		{
+			uint64_t& object = live[r._object];
+			if (object != 0)
+			{
+				++trace._lostFrees;
+			}
+			// live 里存编号加一，0 表示地址空闲
+			object = ++trace._objects;
+			ops.push_back({ object - 1, r.Size(), TRACE_ALLOC });
+			++trace._allocs;
+		}
+		else
+		{
+			auto obj = live.find(r._object);
+			if (obj == live.end() || obj->second == 0)
+			{
+				++trace._unknownFrees;
+				continue;
+			}
+			ops.push_back({ obj->second - 1, r.Size(), TRACE_FREE });
+			obj->second = 0;
+			++trace._frees;
+		}
+	}
+
+	if (!records.empty())
+	{
+		trace._seconds = (double)(records.back()._time - records.front()._time) / 1e9;
+	}
+	return trace;
+}
+
+// 输出申请尺寸直方图，格式和 SizeClassGen 读的一样
+static void PrintHistogram(const std::vector<TraceRecord>& records)
+{
+	std::map<size_t, size_t> hist;
+	for (const TraceRecord& r : records)
+	{
+		if (r.Op() == TRACE_ALLOC)
+		{
+			++hist[r.Size()];
+		}
+	}
+
+	printf("# size count\n");
+	for (const auto& kv : hist)
+	{
+		printf("%zu %zu\n", kv.first, kv.second);
+	}
+}
+
+// 进程当前和峰值的常驻内存（KB），拿不到时为 0
+static void ResidentKB(size_t& current, size_t& peak)
+{
+	current = 0;
+	peak = 0;
+#ifdef __linux__
+	FILE* f = fopen("/proc/self/statm", "r");
+	if (f != nullptr)
+	{
+		size_t pages = 0, resident = 0;
+		if (fscanf(f, "%zu %zu", &pages, &resident) == 2)
+		{
+			current = resident * (size_t)sysconf(_SC_PAGESIZE) / 1024;
+		}
+		fclose(f);
+	}
+
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+	{
+		peak = (size_t)usage.ru_maxrss;
+	}
+#endif
+}
+
+// 每个线程一条操作序列；对象槽位在申请后写入，跨线程释放的一方等槽位非空再释放
+// 释放总排在同一对象的申请之后，等待链只会指向时间更早的操作，不会互相等死
+template <class Alloc, class Free>
+static double Replay(const ReplayTrace& trace, std::atomic<void*>* objects, Alloc alloc, Free free)
+{
+	std::atomic<size_t> ready{ 0 };
+	std::atomic<bool> go{ false };
+
+	std::vector<std::thread> threads;
+	threads.reserve(trace._threads.size());
+	for (const std::vector<ReplayOp>& ops : trace._threads)
+	{
+		threads.emplace_back([&, &ops = ops] {
+			ready.fetch_add(1);
+			while (!go.load(std::memory_order_acquire))
+			{
+				std::this_thread::yield();
+			}
+
+			for (const ReplayOp& op : ops)
+			{
+				if (op._op == TRACE_ALLOC)
+				{
+					void* ptr = alloc(op._size == 0 ? 1 : op._size);
+					// 碰一下对象，真实程序申请了总要用
+					*(volatile char*)ptr = 0;
+					objects[op._object].store(ptr, std::memory_order_release);
+				}
+				else
+				{
+					void* ptr = nullptr;
+					while ((ptr = objects[op._object].load(std::memory_order_acquire)) == nullptr)
+					{
+						std::this_thread::yield();
+					}
+					free(ptr);
+				}
+			}
+		});
+	}
+
+	while (ready.load() != threads.size())
+	{
+		std::this_thread::yield();
+	}
+
+	auto begin = std::chrono::steady_clock::now();
+	go.store(true, std::memory_order_release);
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	return std::chrono::duration<double>(end - begin).count();
+}
+
+static void Usage()
+{
+	fprintf(stderr, "usage: TraceReplay [--system] trace.bin\n");
+	fprintf(stderr, "       TraceReplay --histogram trace.bin > histogram.txt\n");
+	fprintf(stderr, "  --system     replay against system malloc/free instead of the pool\n");
+	fprintf(stderr, "  --histogram  print allocation sizes as SizeClassGen input and exit\n");
+}
+
+int main(int argc, char** argv)
+{
+	bool useSystem = false;
+	bool histogram = false;
+	const char* path = nullptr;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--system") == 0)
+		{
+			useSystem = true;
+		}
+		else if (strcmp(argv[i], "--histogram") == 0)
+		{
+			histogram = true;
+		}
+		else if (argv[i][0] == '-')
+		{
+			Usage();
+			return 1;
+		}
+		else
+		{
+			path = argv[i];
+		}
+	}
+	if (path == nullptr)
+	{
+		Usage();
+		return 1;
+	}
+
+	std::vector<TraceRecord> records;
+	if (!ReadTrace(path, records))
+	{
+		return 1;
+	}
+	if (histogram)
+	{
+		PrintHistogram(records);
+		return 0;
+	}
+
+	ReplayTrace trace = BuildReplay(records);
+	records.clear();
+	records.shrink_to_fit();
+
+	fprintf(stderr, "%zu threads, %zu allocs, %zu frees over %.3f s recorded", trace._threads.size(),
+		trace._allocs, trace._frees, trace._seconds);
+	if (trace._unknownFrees > 0 || trace._lostFrees > 0)
+	{
+		fprintf(stderr, " (skipped %zu frees of objects allocated before recording, %zu objects never freed in the trace)",
+			trace._unknownFrees, trace._lostFrees);
+	}
+	fprintf(stderr, "\n");
+
+	std::unique_ptr<std::atomic<void*>[]> slots(new std::atomic<void*>[trace._objects + 1]());
+
+	size_t rssBefore = 0, peakBefore = 0;
+	ResidentKB(rssBefore, peakBefore);
+
+	double seconds = 0;
+	if (useSystem)
+	{
+		seconds = Replay(trace, slots.get(), [](size_t size) { return malloc(size); }, [](void* ptr) { free(ptr); });
+	}
+	else
+	{
+		seconds = Replay(trace, slots.get(), [](size_t size) { return ConcurrentAlloc(size); }, [](void* ptr) { ConcurrentFree(ptr); });
+	}
+
+	size_t rssAfter = 0, peakAfter = 0;
+	ResidentKB(rssAfter, peakAfter);
+
+	size_t ops = trace._allocs + trace._frees;
+	printf("%s: %.3f ms, %.1f ns/op, %.2f Mops/s\n", useSystem ? "system malloc" : "ConcurrentAlloc",
+		seconds * 1e3, ops > 0 ? seconds * 1e9 / (double)ops : 0.0, seconds > 0 ? (double)ops / seconds / 1e6 : 0.0);
+	printf("rss: %zu KB before replay, %zu KB after, peak %zu KB\n", rssBefore, rssAfter, peakAfter);
+	if (!useSystem)
+	{
+		AllocatorStats stats = GetAllocatorStats();
+		printf("pool: %zu KB requested from the system\n", stats._systemBytes / 1024);
+	}
+
+	// 轨迹结束时还活着的对象不计时释放掉
+	size_t live = 0;
+	std::vector<char> freed(trace._objects, 0);
+	for (const std::vector<ReplayOp>& ops : trace._threads)
+	{
+		for (const ReplayOp& op : ops)
+		{
+			if (op._op == TRACE_FREE)
+			{
+				freed[op._object] = 1;
+			}
+		}
+	}
+	for (size_t i = 0; i < trace._objects; ++i)
+	{
+		if (!freed[i])
+		{
+			void* ptr = slots[i].load();
+			useSystem ? free(ptr) : ConcurrentFree(ptr);
+			++live;
+		}
+	}
+	printf("%zu objects still live at the end of the trace\n", live);
+
+	return 0;
+}
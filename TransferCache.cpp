@@ -0,0 +1,146 @@
+﻿#include "TransferCache.h"
+#include "CentralCache.h"
+#include "AllocatorStats.h"
+
+TransferCache::TransferCache()
+{
+	// 一批的字节数约为 NumMoveSize * size，按字节上限换算能存几批，至少 1 批
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		size_t size = SizeClass::ClassSize(i);
+		size_t batchBytes = SizeClass::NumMoveSize(size) * size;
+		size_t cap = TRANSFER_CLASS_BYTES / batchBytes;
+		cap = (std::max)(cap, (size_t)1);
+		cap = (std::min)(cap, TRANSFER_MAX_BATCHES);
+		_buckets[i]._capacity = cap;
+	}
+}
+
+size_t TransferCache::RemoveRange(size_t index, void*& start, void*& end, size_t batchNum)
+{
+	assert(batchNum > 0);
+	Bucket& bucket = _buckets[index];
+
+	std::lock_guard<std::mutex> lock(bucket._mtx);
+	if (bucket._used == 0)
+	{
+		++bucket._misses;
+		return 0;
+	}
+
+	TransferBatch& top = bucket._batches[bucket._used - 1];
+	if (top._n <= batchNum)
+	{
+		// 整批交出：O(1)
+		start = top._start;
+		end = top._end;
+		size_t n = top._n;
+		--bucket._used;
+		_totalBytes.fetch_sub(n * SizeClass::ClassSize(index), std::memory_order_relaxed);
+		return n;
+	}
+
+	// 这一批比要的多（各线程慢启动阈值不同），切 batchNum 个出去，剩下的留在原位
+	start = top._start;
+	end = start;
+	for (size_t i = 0; i < batchNum - 1; ++i)
+	{
+		end = NextObj(end);
+	}
+
+	top._start = NextObj(end);
+	top._n -= batchNum;
+	NextObj(end) = nullptr;
+	_totalBytes.fetch_sub(batchNum * SizeClass::ClassSize(index), std::memory_order_relaxed);
+
+	return batchNum;
+}
+
+bool TransferCache::InsertRange(size_t index, void* start, void* end, size_t n)
+{
+	assert(start && end && n > 0);
+	assert(NextObj(end) == nullptr);
+	Bucket& bucket = _buckets[index];
+
+	size_t bytes = n * SizeClass::ClassSize(index);
+	std::lock_guard<std::mutex> lock(bucket._mtx);
+	if (bucket._used == bucket._capacity)
+	{
+		++bucket._misses;
+		return false;
+	}
+
+	// 总量上限：先占上再检查，并发超出时退回，不用全局锁
+	if (_totalBytes.fetch_add(bytes, std::memory_order_relaxed) + bytes > TRANSFER_MAX_TOTAL_BYTES)
+	{
+		_totalBytes.fetch_sub(bytes, std::memory_order_relaxed);
+		++bucket._misses;
+		return false;
+	}
+
+	TransferBatch& slot = bucket._batches[bucket._used++];
+	slot._start = start;
+	slot._end = end;
+	slot._n = n;
+
+	return true;
+}
+
+void TransferCache::Flush()
+{
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		Bucket& bucket = _buckets[i];
+		size_t size = SizeClass::ClassSize(i);
+
+		// 一次取一批，还给 CentralCache 时不拿着桶锁
+		while (true)
+		{
+			TransferBatch batch;
+			{
+				std::lock_guard<std::mutex> lock(bucket._mtx);
+				if (bucket._used == 0)
+				{
+					break;
+				}
+
+				batch = bucket._batches[--bucket._used];
+				_totalBytes.fetch_sub(batch._n * size, std::memory_order_relaxed);
+			}
+
+			CentralCache::GetInstance()->ReleaseListToSpans(batch._start, size);
+		}
+	}
+}
+
+void TransferCache::CollectStats(AllocatorStats& stats)
+{
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		Bucket& bucket = _buckets[i];
+		SizeClassStats& cls = stats._classes[i];
+
+		std::lock_guard<std::mutex> lock(bucket._mtx);
+		for (size_t j = 0; j < bucket._used; ++j)
+		{
+			cls._transferCacheBytes += bucket._batches[j]._n * SizeClass::ClassSize(i);
+		}
+		cls._transferCacheMisses += bucket._misses;
+	}
+}
+
+void TransferCache::LockAll()
+{
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		_buckets[i]._mtx.lock();
+	}
+}
+
+void TransferCache::UnlockAll()
+{
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		_buckets[i]._mtx.unlock();
+	}
+}
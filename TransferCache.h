@@ -0,0 +1,67 @@
+﻿#pragma once
+#include "Common.h"
+
+struct AllocatorStats;
+
+// 每个尺寸类最多暂存的批次数
+static const size_t TRANSFER_MAX_BATCHES = 64;
+// 每个尺寸类最多暂存的字节数，决定实际能存几批
+static const size_t TRANSFER_CLASS_BYTES = 256 * 1024;
+// 所有尺寸类合计最多暂存的字节数：各尺寸类的上限加起来有几十 MB，这些内存不计入线程缓存预算，也不会被后台归还
+static const size_t TRANSFER_MAX_TOTAL_BYTES = 8 * 1024 * 1024;
+
+// 一批对象：ThreadCache 的 FreeList 是侵入式链表，存头尾和个数就能 O(1) 整批交接
+struct TransferBatch
+{
+	void* _start = nullptr;
+	void* _end = nullptr;
+	size_t _n = 0;
+};
+
+// 位于 ThreadCache 和 CentralCache 之间，按尺寸类暂存整批对象
+// 一个线程还回来的一批可以原样交给另一个线程，不碰任何 Span，也不查页表
+// 单例模式
+class TransferCache
+{
+public:
+	static TransferCache* GetInstance()
+	{
+		return LeakySingleton<TransferCache>();
+	}
+
+	// 取出最多 batchNum 个对象，返回实际个数；没有暂存的批次返回 0
+	size_t RemoveRange(size_t index, void*& start, void*& end, size_t batchNum);
+
+	// 暂存一批对象（end 的 next 必须为空），本尺寸类满了或者总量超过上限返回 false，由调用方还给 CentralCache
+	bool InsertRange(size_t index, void* start, void* end, size_t n);
+
+	// 把所有暂存的批次还给 CentralCache，span 全部回来后才能继续还给 PageCache 和系统
+	void Flush();
+
+	// 累加每个尺寸类暂存的字节数和未命中次数
+	void CollectStats(AllocatorStats& stats);
+
+	// fork 前后调用：子进程只有 fork 的那个线程，别的线程持有的锁必须在 fork 时处于可用状态
+	void LockAll();
+	void UnlockAll();
+
+private:
+	struct Bucket
+	{
+		std::mutex _mtx;								// 桶锁，只保护 O(1) 的出入栈
+		TransferBatch _batches[TRANSFER_MAX_BATCHES];	// 栈：后进先出，刚还回来的对象更可能还在 cache 里
+		size_t _used = 0;
+		size_t _capacity = 0;
+		size_t _misses = 0;								// 取不到 / 放不下的次数
+	};
+
+	Bucket _buckets[NFREELISTS];
+	// 所有桶暂存的字节数合计，在桶锁内增减
+	std::atomic<size_t> _totalBytes{ 0 };
+
+private:
+	TransferCache();
+
+	TransferCache(const TransferCache&) = delete;
+	friend TransferCache* LeakySingleton<TransferCache>();
+};
@@ -4,6 +4,8 @@
 #include "ObjectPool.h"
 #include "ConcurrentAlloc.h"
 #include <random>
+#include <cstring>
+#include <sstream>
 
 // 覆盖对齐边界尺寸，验证分桶映射稳定
 static void TestBoundarySizes()
@@ -32,6 +34,89 @@ static void TestBoundarySizes()
     }
 }
 
+// 查表映射和逐个比较尺寸类列表的结果一致：每个尺寸都落在能装下它的最小尺寸类
+static void TestSizeClassTables()
+{
+    size_t cls = 0;
+    for (size_t size = 1; size <= MAX_BYTES; ++size)
+    {
+        while (kSizeClasses._sizes[cls] < size)
+        {
+            ++cls;
+        }
+        assert(SizeClass::Index(size) == cls);
+        assert(SizeClass::RoundUp(size) == kSizeClasses._sizes[cls]);
+    }
+    assert(cls == NFREELISTS - 1);
+
+    for (size_t i = 0; i < NFREELISTS; ++i)
+    {
+        assert(SizeClass::Index(SizeClass::ClassSize(i)) == i);
+
+        // span 页数：至少装下一个对象，末尾浪费的比例不比按批量换算的页数差
+        size_t size = SizeClass::ClassSize(i);
+        size_t pages = SizeClass::NumMovePage(size);
+        size_t batchBytes = BatchSpanPages(size) << PAGE_SHIFT;
+        assert(pages >= 1 && pages < NPAGES);
+        assert((pages << PAGE_SHIFT) >= size);
+        assert(SizeClass::SpanTailBytes(i) * batchBytes <= (batchBytes % size) * (pages << PAGE_SHIFT));
+    }
+}
+
+// 带大小释放：小对象直接按 size 回桶，大对象仍走页级释放
+static void TestSizedFree()
+{
+    const size_t kIters = 1000;
+    const size_t sizes[] = { 1, 8, 129, 1025, 8193, 65537, MAX_BYTES, MAX_BYTES + 1 };
+
+    for (size_t s : sizes)
+    {
+        std::vector<void*> v;
+        v.reserve(kIters);
+        for (size_t i = 0; i < kIters; ++i)
+        {
+            void* p = ConcurrentAlloc(s);
+            // 页表旁路的尺寸类必须与 size 对应的桶一致
+            size_t sizeClass = PageCache::GetInstance()->MapObjectToSizeClass(p);
+            if (s <= MAX_BYTES)
+            {
+                assert(sizeClass == SizeClass::Index(s) + 1);
+                assert(SizeClass::ClassSize(sizeClass - 1) == SizeClass::RoundUp(s));
+            }
+            else
+            {
+                assert(sizeClass == NO_SIZE_CLASS);
+            }
+            (void)sizeClass;
+            v.push_back(p);
+        }
+        for (void* p : v)
+        {
+            ConcurrentFreeSized(p, s);
+        }
+    }
+}
+
+// 页桶位图：跨字边界查找
+static void TestBitmap()
+{
+    Bitmap<NPAGES> bm;
+    assert(bm.FindFirstSet(0) == NPAGES);
+
+    bm.Set(3);
+    bm.Set(64);
+    bm.Set(NPAGES - 1);
+    assert(bm.FindFirstSet(0) == 3);
+    assert(bm.FindFirstSet(3) == 3);
+    assert(bm.FindFirstSet(4) == 64);
+    assert(bm.FindFirstSet(65) == NPAGES - 1);
+
+    bm.Clear(64);
+    assert(!bm.Test(64));
+    assert(bm.FindFirstSet(4) == NPAGES - 1);
+    (void)bm;
+}
+
 // 走大对象路径，验证页级分配/释放
 static void TestLargeAlloc()
 {
@@ -58,6 +143,232 @@ static void TestLargeAlloc()
     }
 }
 
+// 对齐申请：各种尺寸和 2 的幂对齐都满足对齐要求，一页以内用尺寸类满足，更大的对齐不多占页
+static void TestAlignedAlloc()
+{
+    const size_t sizes[] = { 1, 24, 100, 1000, 5000, 70000, MAX_BYTES, MAX_BYTES + 1, 1024 * 1024 };
+
+    for (size_t align = 8; align <= 1024 * 1024; align <<= 1)
+    {
+        std::vector<void*> v;
+        for (size_t s : sizes)
+        {
+            for (int i = 0; i < 3; ++i)
+            {
+                void* p = ConcurrentAllocAligned(s, align);
+                assert((uintptr_t)p % align == 0);
+                memset(p, 0x5a, s);
+                v.push_back(p);
+            }
+        }
+        for (void* p : v)
+        {
+            ConcurrentFree(p);
+        }
+    }
+
+    // 一页以内的对齐由尺寸类满足：64 字节对齐的 100 字节对象来自 128 字节的尺寸类
+    void* p = ConcurrentAllocAligned(100, 64);
+    assert(PageCache::GetInstance()->MapObjectToSizeClass(p) == SizeClass::Index(128) + 1);
+    ConcurrentFree(p);
+
+    // 更大的对齐不多占页：1MB 对齐的 1MB 对象正好 1MB
+    p = ConcurrentAllocAligned(1024 * 1024, 1024 * 1024);
+    assert(PageCache::GetInstance()->MapObjectToSpan(p)->_n == (1024 * 1024) >> PAGE_SHIFT);
+    ConcurrentFree(p);
+}
+
+// 调整大小：原尺寸类内和大对象的原地伸缩、换到新内存块时保留内容、空指针和 0 大小的语义
+static void TestRealloc()
+{
+    // 还在原尺寸类里：原地返回
+    char* p = (char*)ConcurrentAlloc(100);
+    memset(p, 0x11, 100);
+    assert(ConcurrentRealloc(p, SizeClass::RoundUp(100)) == p);
+    const size_t half = SizeClass::RoundUp(100) / 2;
+    assert(ConcurrentRealloc(p, half) == p);
+
+    // 小对象长成大对象：拷贝，内容保留
+    p = (char*)ConcurrentRealloc(p, MAX_BYTES + 1);
+    for (size_t i = 0; i < half; ++i)
+    {
+        assert(p[i] == 0x11);
+    }
+
+    // 大对象原地缩小，尾部页还回去后又能原地长回来
+    const size_t kPage = (size_t)1 << PAGE_SHIFT;
+    p = (char*)ConcurrentRealloc(p, 100 * kPage);
+    memset(p, 0x22, 100 * kPage);
+    char* q = (char*)ConcurrentRealloc(p, 40 * kPage);
+    assert(q == p);
+    assert(PageCache::GetInstance()->MapObjectToSpan(p)->_n == 40);
+    q = (char*)ConcurrentRealloc(p, 80 * kPage);
+    assert(q == p);
+    assert(PageCache::GetInstance()->MapObjectToSpan(p + 79 * kPage) == PageCache::GetInstance()->MapObjectToSpan(p));
+    assert(p[40 * kPage - 1] == 0x22);
+    memset(p, 0x33, 80 * kPage);
+
+    // 缩到小对象范围：换成尺寸类对象
+    p = (char*)ConcurrentRealloc(p, 1000);
+    assert(PageCache::GetInstance()->MapObjectToSizeClass(p) != NO_SIZE_CLASS);
+    assert(p[999] == 0x33);
+
+    assert(ConcurrentRealloc(p, 0) == nullptr);
+    p = (char*)ConcurrentRealloc(nullptr, 10);
+    ConcurrentFree(p);
+    (void)q;
+}
+
+// 批量申请释放：跨多个 span 的一批对象各不相同且尺寸类正确，混合尺寸类和大对象的批量释放
+static void TestBatchAlloc()
+{
+    // 超过一次批量上限、跨多个 span 的一批
+    const size_t sizes[] = { 8, 48, 1000, 20000 };
+    const size_t counts[] = { 1, 32, 256, 5000 };
+    for (size_t s : sizes)
+    {
+        for (size_t n : counts)
+        {
+            std::vector<void*> v(n);
+            ConcurrentAllocBatch(s, n, v.data());
+            for (void* p : v)
+            {
+                assert(PageCache::GetInstance()->MapObjectToSizeClass(p) == SizeClass::Index(s) + 1);
+                memset(p, 0x44, s);
+            }
+            std::vector<void*> sorted(v);
+            std::sort(sorted.begin(), sorted.end());
+            assert(std::unique(sorted.begin(), sorted.end()) == sorted.end());
+
+            ConcurrentFreeBatch(v.data(), n);
+        }
+    }
+
+    // 混合释放：不同尺寸类、大对象交错
+    std::vector<void*> mixed;
+    for (size_t i = 0; i < 300; ++i)
+    {
+        mixed.push_back(ConcurrentAlloc(i % 3 == 0 ? 64 : (i % 3 == 1 ? 4096 : MAX_BYTES + 1)));
+        mixed.push_back(ConcurrentAlloc(64));
+    }
+    ConcurrentFreeBatch(mixed.data(), mixed.size());
+}
+
+// 线程缓存总预算：多个线程互相偷上限，各线程上限之和和实际缓存的字节数都受总预算约束
+static void TestThreadCacheBudget()
+{
+    const size_t kBudget = 1024 * 1024;
+    const size_t kThreads = 8;
+    ConcurrentSetThreadCacheBudget(kBudget);
+    // 本线程之前的测试缓存了不少对象，走一次释放的慢路径按新上限收缩
+    ConcurrentFree(ConcurrentAlloc(8));
+
+    // 每个线程释放 20 个尺寸类、每类接近一个批量上限的对象；不设上限时每个线程能缓存好几 MB
+    std::atomic<size_t> done{ 0 };
+    std::atomic<size_t> turn{ 0 };
+    std::atomic<bool> exit{ false };
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < kThreads; ++t)
+    {
+        threads.emplace_back([&, t]() {
+            for (int round = 0; round < 3; ++round)
+            {
+                for (size_t size = 1024; size <= 20 * 1024; size += 1024)
+                {
+                    std::vector<void*> v;
+                    for (size_t i = 0; i < SizeClass::NumMoveSize(size); ++i)
+                    {
+                        v.push_back(ConcurrentAlloc(size));
+                    }
+                    for (void* p : v)
+                    {
+                        ConcurrentFree(p);
+                    }
+                }
+            }
+
+            // 上限被别的线程偷走后要等下次慢路径才收缩：全部跑完后按顺序各走一次释放
+            ++done;
+            while (done < kThreads || turn != t)
+            {
+                std::this_thread::yield();
+            }
+            ConcurrentFree(ConcurrentAlloc(1024));
+            ++turn;
+
+            while (!exit)
+            {
+                std::this_thread::yield();
+            }
+        });
+    }
+
+    while (turn < kThreads)
+    {
+        std::this_thread::yield();
+    }
+    ConcurrentFree(ConcurrentAlloc(8));
+
+    AllocatorStats stats = GetAllocatorStats();
+    assert(stats._threadCacheBudget == kBudget);
+    // 偷来偷去总量不变：分给各线程的上限之和不超过总上限
+    assert(stats._threadCacheLimitBytes <= kBudget);
+#ifdef PERCPU_CACHE_ENABLED
+    if (!CpuCache::Active())
+#endif
+    {
+        // 每次收缩后最多再偷一份，缓存的字节数只比总上限多出几份 THREAD_CACHE_STEAL_BYTES
+        assert(stats._smallTotal._threadCacheBytes <= kBudget + (kThreads + 1) * THREAD_CACHE_STEAL_BYTES);
+    }
+
+    exit = true;
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+
+    ConcurrentSetThreadCacheBudget(THREAD_CACHE_DEFAULT_BUDGET);
+    (void)stats;
+}
+
+// 自适应批量：反复申请释放超过一个批量的工作集，桶的长度上限涨上来后不再走慢路径
+static void TestAdaptiveBatch()
+{
+#ifdef PERCPU_CACHE_ENABLED
+    if (CpuCache::Active())
+    {
+        return;
+    }
+#endif
+    // 反复申请再释放一组比一批多的对象：慢启动到一批之后，落空一次长度上限就能装下整组，之后不再走慢路径
+    const size_t size = 1024;
+    const size_t index = SizeClass::Index(size);
+    const size_t working = SizeClass::NumMoveSize(size) * 3 / 2;
+
+    std::thread t([&]() {
+        std::vector<void*> v(working);
+        size_t misses = 0;
+        for (int round = 0; round < 100; ++round)
+        {
+            if (round == 60)
+            {
+                misses = GetAllocatorStats()._classes[index]._threadCacheMisses;
+            }
+            for (size_t i = 0; i < working; ++i)
+            {
+                v[i] = ConcurrentAlloc(size);
+            }
+            for (size_t i = 0; i < working; ++i)
+            {
+                ConcurrentFree(v[i]);
+            }
+        }
+        assert(GetAllocatorStats()._classes[index]._threadCacheMisses == misses);
+        (void)misses;
+    });
+    t.join();
+}
+
 // 跨线程释放，覆盖 CentralCache 回收路径
 static void TestCrossThreadFree()
 {
@@ -97,6 +408,48 @@ static void TestCrossThreadFree()
     }
 }
 
+// 线程退出：ThreadCache 析构后，更晚析构的线程局部对象仍能正常释放
+struct LateFreeHolder
+{
+    void* ptr = nullptr;
+    ~LateFreeHolder()
+    {
+        if (ptr != nullptr)
+        {
+            ConcurrentFree(ptr);
+        }
+    }
+};
+
+static void TestThreadExit()
+{
+    const size_t rounds = 20;
+    const size_t n = 2000;
+
+    for (size_t r = 0; r < rounds; ++r)
+    {
+        std::thread t([&] {
+            // holder 先于 ThreadCache 构造，所以在它之后析构
+            thread_local LateFreeHolder holder;
+            holder.ptr = nullptr;
+
+            std::vector<void*> v;
+            v.reserve(n);
+            for (size_t i = 0; i < n; ++i)
+            {
+                v.push_back(ConcurrentAlloc((i % 1024) + 1));
+            }
+            for (void* p : v)
+            {
+                ConcurrentFree(p);
+            }
+
+            holder.ptr = ConcurrentAlloc(64);
+        });
+        t.join();
+    }
+}
+
 // 随机大小 + 乱序释放，模拟真实负载
 static void TestRandomMixed()
 {
@@ -146,13 +499,366 @@ static void TestRandomMixed()
     }
 }
 
+// 中转缓存总量上限：每个尺寸类都还回超过单类上限的对象，合计暂存的字节数也不超过总上限
+static void TestTransferCacheLimit()
+{
+    const size_t kBytesPerClass = 320 * 1024;
+
+    std::thread t([&] {
+        std::vector<void*> v;
+        for (size_t i = 0; i < NFREELISTS; ++i)
+        {
+            size_t size = SizeClass::ClassSize(i);
+            for (size_t n = 0; n < (std::max)(kBytesPerClass / size, (size_t)2); ++n)
+            {
+                v.push_back(ConcurrentAlloc(size));
+            }
+        }
+        for (void* p : v)
+        {
+            ConcurrentFree(p);
+        }
+    });
+    t.join();
+
+    AllocatorStats stats = GetAllocatorStats();
+    assert(stats._smallTotal._transferCacheBytes <= TRANSFER_MAX_TOTAL_BYTES);
+    (void)stats;
+
+    ConcurrentReleaseFreeMemory();
+}
+
+// 归还空闲页：已提交的空闲页清零，归还后的内存还能正常复用（读到的是全零页）
+static void TestReleaseFreeMemory()
+{
+    const size_t kIters = 64;
+    const size_t sizes[] = { 64, 4096, MAX_BYTES + 1, 2 * 1024 * 1024 };
+
+    for (size_t s : sizes)
+    {
+        std::vector<void*> v;
+        v.reserve(kIters);
+        for (size_t i = 0; i < kIters; ++i)
+        {
+            void* p = ConcurrentAlloc(s);
+            memset(p, 0xab, s);
+            v.push_back(p);
+        }
+        for (void* p : v)
+        {
+            ConcurrentFree(p);
+        }
+    }
+
+    ConcurrentReleaseFreeMemory();
+    {
+        std::lock_guard<std::mutex> lock(PageCache::GetInstance()->_pageMtx);
+        assert(PageCache::GetInstance()->FreeCommittedBytes() == 0);
+        assert(PageCache::GetInstance()->FreeReleasedBytes() > 0);
+    }
+
+    for (size_t s : sizes)
+    {
+        std::vector<void*> v;
+        v.reserve(kIters);
+        for (size_t i = 0; i < kIters; ++i)
+        {
+            void* p = ConcurrentAlloc(s);
+            memset(p, 0xcd, s);
+            assert(((unsigned char*)p)[s - 1] == 0xcd);
+            v.push_back(p);
+        }
+        for (void* p : v)
+        {
+            ConcurrentFree(p);
+        }
+    }
+
+    // 按速率归还：切大 span 时只还额度内的页（大页模式下按整大页取整）
+    {
+        std::lock_guard<std::mutex> lock(PageCache::GetInstance()->_pageMtx);
+        size_t before = PageCache::GetInstance()->FreeCommittedBytes();
+        size_t released = PageCache::GetInstance()->ReleaseAtMost(3 << PAGE_SHIFT);
+#ifdef USE_HUGEPAGE_HEAP
+        assert(released <= before && released <= HUGEPAGE_BYTES);
+        assert(released >= (before < (3 << PAGE_SHIFT) ? before : (3 << PAGE_SHIFT)));
+#else
+        assert(released <= (3 << PAGE_SHIFT));
+        assert(released == (before < (3 << PAGE_SHIFT) ? before : (3 << PAGE_SHIFT)));
+#endif
+        assert(PageCache::GetInstance()->FreeCommittedBytes() == before - released);
+        (void)before;
+        (void)released;
+    }
+}
+
+// 统计：应用持有的对象计入 inuse，释放后回到各级缓存
+static void TestAllocatorStats()
+{
+    const size_t kObjs = 10000;
+    const size_t kSize = 100;
+    const size_t kLarge = 1024 * 1024;
+    size_t index = SizeClass::Index(kSize);
+    size_t objBytes = kObjs * SizeClass::RoundUp(kSize);
+
+    AllocatorStats before = GetAllocatorStats();
+
+    std::vector<void*> v;
+    v.reserve(kObjs);
+    for (size_t i = 0; i < kObjs; ++i)
+    {
+        v.push_back(ConcurrentAlloc(kSize));
+    }
+    void* large = ConcurrentAlloc(kLarge);
+
+    AllocatorStats held = GetAllocatorStats();
+    assert(held._classes[index]._inUseBytes >= before._classes[index]._inUseBytes + objBytes);
+    assert(held._largeInUseBytes >= before._largeInUseBytes + kLarge);
+    assert(held._classes[index]._threadCacheMisses > before._classes[index]._threadCacheMisses);
+    assert(held._classes[index]._spans > 0);
+
+    for (void* p : v)
+    {
+        ConcurrentFree(p);
+    }
+    ConcurrentFree(large);
+
+    AllocatorStats freed = GetAllocatorStats();
+    assert(freed._classes[index]._inUseBytes + objBytes <= held._classes[index]._inUseBytes);
+    assert(freed._largeInUseBytes + kLarge <= held._largeInUseBytes);
+
+    std::ostringstream os;
+    freed.Print(os);
+    assert(!os.str().empty());
+}
+
+// 堆采样：存活对象被按间隔采中，释放后采样记录随之摘掉；采样对象的带大小释放也要正确
+static void TestHeapProfiler()
+{
+    const size_t kObjs = 20000;
+    const size_t kSize = 100;
+
+    ConcurrentSetProfileSampleRate(4096);
+
+    std::vector<void*> v;
+    v.reserve(kObjs + 10);
+    for (size_t i = 0; i < kObjs; ++i)
+    {
+        void* p = ConcurrentAlloc(kSize);
+        memset(p, 0x5a, kSize);
+        v.push_back(p);
+    }
+    for (size_t i = 0; i < 10; ++i)
+    {
+        v.push_back(ConcurrentAlloc(MAX_BYTES + 1));
+    }
+
+    // 打开后最多 PROFILE_DISABLED_INTERVAL 字节才生效，剩下约 100 万字节 / 4096，允许随机波动
+    size_t expect = 100;
+    size_t live = HeapProfiler::GetInstance()->LiveSamples();
+    assert(live >= expect);
+    (void)live;
+    (void)expect;
+
+    std::ostringstream os;
+    ConcurrentDumpHeapProfile(os);
+    assert(os.str().find("heap profile:") == 0);
+    assert(os.str().find("bytes") != std::string::npos);
+
+    ConcurrentSetProfileSampleRate(0);
+
+    for (size_t i = 0; i < kObjs; ++i)
+    {
+        ConcurrentFreeSized(v[i], kSize);
+    }
+    for (size_t i = kObjs; i < v.size(); ++i)
+    {
+        ConcurrentFree(v[i]);
+    }
+    assert(HeapProfiler::GetInstance()->LiveSamples() == 0);
+}
+
+#ifdef PERCPU_CACHE_ENABLED
+// 每 CPU 缓存模式的堆采样：只申请小对象也能采中，采样计数在线程局部变量里
+static void TestHeapProfilerPerCpu()
+{
+    if (!CpuCache::Active())
+    {
+        return;
+    }
+
+    const size_t kObjs = 40000;
+    const size_t kSize = 64;
+
+    ConcurrentSetProfileSampleRate(4096);
+
+    // 新线程的计数从头开始：约 2.5MB 里最多 PROFILE_DISABLED_INTERVAL 字节不采
+    std::vector<void*> v(kObjs);
+    std::thread t([&] {
+        for (size_t i = 0; i < kObjs; ++i)
+        {
+            v[i] = ConcurrentAlloc(kSize);
+        }
+    });
+    t.join();
+
+    size_t live = HeapProfiler::GetInstance()->LiveSamples();
+    assert(live >= 100);
+    (void)live;
+
+    ConcurrentSetProfileSampleRate(0);
+
+    for (void* p : v)
+    {
+        ConcurrentFreeSized(p, kSize);
+    }
+    assert(HeapProfiler::GetInstance()->LiveSamples() == 0);
+
+    // 只申请释放大对象的线程不构造 ThreadCache（线程退出前检查，退出后本来就会注销）
+    size_t caches = GetAllocatorStats()._threadCaches;
+    std::thread large([caches] {
+        for (size_t i = 0; i < 10; ++i)
+        {
+            ConcurrentFree(ConcurrentAlloc(MAX_BYTES + 1));
+        }
+        assert(GetAllocatorStats()._threadCaches == caches);
+    });
+    large.join();
+    (void)caches;
+}
+#endif
+
+#ifdef ALLOC_TRACE_ENABLED
+// 申请释放轨迹：每次申请、释放各一条，线程号区分线程，同一地址按时间申请释放交替出现
+static void TestAllocTrace()
+{
+    const char* path = "UnitTestTrace.bin";
+    const size_t kObjs = 10000;
+    const size_t kOwn = 3000;
+
+    bool started = ConcurrentStartTrace(path);
+    assert(started);
+    (void)started;
+
+    std::vector<void*> v;
+    v.reserve(kObjs);
+    for (size_t i = 0; i < kObjs; ++i)
+    {
+        v.push_back(ConcurrentAlloc(i == 0 ? MAX_BYTES + 1 : (i % 2048) + 1));
+    }
+
+    // 另一个线程释放前一半，再申请释放自己的对象
+    std::thread t([&] {
+        for (size_t i = 0; i < kObjs / 2; ++i)
+        {
+            ConcurrentFree(v[i]);
+        }
+        for (size_t i = 0; i < kOwn; ++i)
+        {
+            ConcurrentFree(ConcurrentAlloc(64));
+        }
+    });
+    t.join();
+
+    for (size_t i = kObjs / 2; i < kObjs; ++i)
+    {
+        ConcurrentFree(v[i]);
+    }
+
+    size_t written = ConcurrentStopTrace();
+    assert(written == 2 * kObjs + 2 * kOwn);
+
+    FILE* f = fopen(path, "rb");
+    assert(f != nullptr);
+    TraceHeader header;
+    size_t got = fread(&header, sizeof(header), 1, f);
+    assert(got == 1 && memcmp(header._magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) == 0);
+    assert(header._version == TRACE_VERSION && header._recordSize == sizeof(TraceRecord));
+    std::vector<TraceRecord> records(written + 1);
+    got = fread(records.data(), sizeof(TraceRecord), records.size(), f);
+    assert(got == written);
+    (void)got;
+    records.resize(written);
+    fclose(f);
+    remove(path);
+
+    std::stable_sort(records.begin(), records.end(), [](const TraceRecord& a, const TraceRecord& b) {
+        return a._time < b._time;
+    });
+
+    std::unordered_map<uint64_t, size_t> live;
+    std::unordered_map<uint32_t, size_t> threads;
+    for (const TraceRecord& r : records)
+    {
+        ++threads[r.Thread()];
+        if (r.Op() == TRACE_ALLOC)
+        {
+            assert(r.Size() > 0);
+            bool inserted = live.emplace(r._object, r.Size()).second;
+            assert(inserted);
+            (void)inserted;
+        }
+        else
+        {
+            size_t erased = live.erase(r._object);
+            assert(erased == 1);
+            (void)erased;
+        }
+    }
+    assert(live.empty());
+    assert(threads.size() == 2);
+    assert(records.front().Size() == MAX_BYTES + 1);
+}
+#endif
+
+#ifdef USE_HUGEPAGE_HEAP
+// 大页模式：向系统要的内存按 2MB 对齐；归还时先还整个的大页
+static void TestHugepageHeap()
+{
+    PageCache* pc = PageCache::GetInstance();
+    std::lock_guard<std::mutex> lock(pc->_pageMtx);
+
+    // 比之前释放过的都大，只能新向系统要：从大页边界开始
+    Span* big = pc->NewSpan(64 * HUGEPAGE_PAGES + 1);
+    assert(big->_pageId % HUGEPAGE_PAGES == 0);
+
+    // 还回来之后有完整的空闲大页，只要一页的额度也按整个大页还
+    pc->ReleaseSpanToPageCache(big);
+    size_t released = pc->ReleaseAtMost(1 << PAGE_SHIFT);
+    assert(released == HUGEPAGE_BYTES);
+    (void)released;
+}
+#endif
+
 #ifdef RUN_EXTRA_TESTS
 int main()
 {
     TestBoundarySizes();
+    TestSizeClassTables();
+    TestSizedFree();
+    TestBitmap();
     TestLargeAlloc();
+    TestAlignedAlloc();
+    TestRealloc();
+    TestBatchAlloc();
     TestCrossThreadFree();
+    TestThreadExit();
     TestRandomMixed();
+    TestTransferCacheLimit();
+    TestReleaseFreeMemory();
+    TestAllocatorStats();
+    TestThreadCacheBudget();
+    TestAdaptiveBatch();
+    TestHeapProfiler();
+#ifdef PERCPU_CACHE_ENABLED
+    TestHeapProfilerPerCpu();
+#endif
+#ifdef ALLOC_TRACE_ENABLED
+    TestAllocTrace();
+#endif
+#ifdef USE_HUGEPAGE_HEAP
+    TestHugepageHeap();
+#endif
 
     cout << "Extra tests: OK" << endl;
     return 0;